@@ -0,0 +1,468 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Mode-batched BC7 decoder. Blocks of a block row are grouped by mode, then
+// each mode batch is decoded by code specialized for the bit layout of that
+// mode in two passes:
+//  - fields (partition, rotation, endpoints and P-bits) of every block of the
+//    batch are unpacked into structure-of-arrays with fixed shifts,
+//  - endpoints are expanded, palettes are interpolated and indices resolved in
+//    SIMD registers: per pixel index fields are gathered with byte shuffles
+//    from per-partition layout tables, palettes are built per channel with
+//    pmaddubsw and looked up with pshufb.
+// The output is bit-exact with bcdec_bc7(), including the transparent black of
+// blocks with an invalid mode.
+
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include "bc_simd.h"
+
+#ifdef BC_SIMD_X86
+
+namespace bc_simd {
+namespace bc7 {
+
+struct ModeInfo {
+    int subsets;
+    int partition_bits;
+    int rotation_bits;
+    int selection_bits; ///< index selection bit
+    int color_bits;
+    int alpha_bits;
+    int pbits;          ///< 0: none, 1: one per subset, 2: one per endpoint
+    int index_bits;
+    int index_bits2;    ///< secondary indices, 0 if none
+};
+
+constexpr ModeInfo modes[8] = {
+    {3, 4, 0, 0, 4, 0, 2, 3, 0},
+    {2, 6, 0, 0, 6, 0, 1, 3, 0},
+    {3, 6, 0, 0, 5, 0, 0, 2, 0},
+    {2, 6, 0, 0, 7, 0, 2, 2, 0},
+    {1, 0, 2, 1, 5, 6, 0, 2, 3},
+    {1, 0, 2, 0, 7, 8, 0, 2, 2},
+    {1, 0, 0, 0, 7, 7, 2, 4, 0},
+    {2, 6, 0, 0, 5, 5, 2, 2, 0},
+};
+
+// Partition tables, bit k (2 subsets) or bits 2k..2k+1 (3 subsets) give the
+// subset of pixel k. Anchors are the pixels whose index has one less bit.
+constexpr uint16_t partition2[64] = {
+    0xcccc, 0x8888, 0xeeee, 0xecc8, 0xc880, 0xfeec, 0xfec8, 0xec80,
+    0xc800, 0xffec, 0xfe80, 0xe800, 0xffe8, 0xff00, 0xfff0, 0xf000,
+    0xf710, 0x008e, 0x7100, 0x08ce, 0x008c, 0x7310, 0x3100, 0x8cce,
+    0x088c, 0x3110, 0x6666, 0x366c, 0x17e8, 0x0ff0, 0x718e, 0x399c,
+    0xaaaa, 0xf0f0, 0x5a5a, 0x33cc, 0x3c3c, 0x55aa, 0x9696, 0xa55a,
+    0x73ce, 0x13c8, 0x324c, 0x3bdc, 0x6996, 0xc33c, 0x9966, 0x0660,
+    0x0272, 0x04e4, 0x4e40, 0x2720, 0xc936, 0x936c, 0x39c6, 0x639c,
+    0x9336, 0x9cc6, 0x817e, 0xe718, 0xccf0, 0x0fcc, 0x7744, 0xee22,
+};
+constexpr uint8_t anchor2[64] = {
+    15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+    15,  2,  8,  2,  2,  8,  8, 15,  2,  8,  2,  2,  8,  8,  2,  2,
+    15, 15,  6,  8,  2,  8, 15, 15,  2,  8,  2,  2,  2, 15, 15,  6,
+     6,  2,  6,  8, 15, 15,  2,  2, 15, 15, 15, 15, 15,  2,  2, 15,
+};
+constexpr uint32_t partition3[64] = {
+    0xaa685050, 0x6a5a5040, 0x5a5a4200, 0x5450a0a8, 0xa5a50000, 0xa0a05050, 0x5555a0a0, 0x5a5a5050,
+    0xaa550000, 0xaa555500, 0xaaaa5500, 0x90909090, 0x94949494, 0xa4a4a4a4, 0xa9a59450, 0x2a0a4250,
+    0xa5945040, 0x0a425054, 0xa5a5a500, 0x55a0a0a0, 0xa8a85454, 0x6a6a4040, 0xa4a45000, 0x1a1a0500,
+    0x0050a4a4, 0xaaa59090, 0x14696914, 0x69691400, 0xa08585a0, 0xaa821414, 0x50a4a450, 0x6a5a0200,
+    0xa9a58000, 0x5090a0a8, 0xa8a09050, 0x24242424, 0x00aa5500, 0x24924924, 0x24499224, 0x50a50a50,
+    0x500aa550, 0xaaaa4444, 0x66660000, 0xa5a0a5a0, 0x50a050a0, 0x69286928, 0x44aaaa44, 0x66666600,
+    0xaa444444, 0x54a854a8, 0x95809580, 0x96969600, 0xa85454a8, 0x80959580, 0xaa141414, 0x96960000,
+    0xaaaa1414, 0xa05050a0, 0xa0a5a5a0, 0x96000000, 0x40804080, 0xa9a8a9a8, 0xaaaaaa44, 0x2a4a5254,
+};
+constexpr uint8_t anchor3[64][2] = {
+    { 3, 15}, { 3,  8}, {15,  8}, {15,  3}, { 8, 15}, { 3, 15}, {15,  3}, {15,  8},
+    { 8, 15}, { 8, 15}, { 6, 15}, { 6, 15}, { 6, 15}, { 5, 15}, { 3, 15}, { 3,  8},
+    { 3, 15}, { 3,  8}, { 8, 15}, {15,  3}, { 3, 15}, { 3,  8}, { 6, 15}, {10,  8},
+    { 5,  3}, { 8, 15}, { 8,  6}, { 6, 10}, { 8, 15}, { 5, 15}, {15, 10}, {15,  8},
+    { 8, 15}, {15,  3}, { 3, 15}, { 5, 10}, { 6, 10}, {10,  8}, { 8,  9}, {15, 10},
+    {15,  6}, { 3, 15}, {15,  8}, { 5, 15}, {15,  3}, {15,  6}, {15,  6}, {15,  8},
+    { 3, 15}, {15,  3}, { 5, 15}, { 5, 15}, { 5, 15}, { 8, 15}, { 5, 15}, {10, 15},
+    { 5, 15}, {10, 15}, { 8, 15}, {13, 15}, {15,  3}, {12, 15}, { 3, 15}, { 3,  8},
+};
+
+constexpr int weights[3][16] = {
+    {0, 21, 43, 64},
+    {0, 9, 18, 27, 37, 46, 55, 64},
+    {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64},
+};
+
+constexpr int Subset(int subsets, int partition, int pixel)
+{
+    return subsets == 1 ? 0
+         : subsets == 2 ? (partition2[partition] >> pixel) & 1
+         : (partition3[partition] >> (2 * pixel)) & 3;
+}
+
+constexpr bool Anchor(int subsets, int partition, int pixel)
+{
+    return pixel == 0
+        || (subsets == 2 && pixel == anchor2[partition])
+        || (subsets == 3 && (pixel == anchor3[partition][0] || pixel == anchor3[partition][1]));
+}
+
+// Bit offset of the first primary index of a block
+constexpr int IndexStart(int mode)
+{
+    const ModeInfo& m = modes[mode];
+    const int endpoints = 2 * m.subsets;
+    const int pbits = m.pbits == 2 ? endpoints : m.pbits == 1 ? m.subsets : 0;
+    return mode + 1 + m.partition_bits + m.rotation_bits + m.selection_bits
+         + endpoints * (3 * m.color_bits + m.alpha_bits) + pbits;
+}
+
+// Where the 16 indices of a block are: index k is gathered by pshufb from the
+// 2 bytes holding it into 16-bit lane k, moved to bit 7 by a multiply and masked
+struct alignas(16) IndexLayout {
+    uint8_t bytes[2][16];
+    uint16_t scale[2][8]; ///< 1 << (7 - bit offset of the index in its first byte)
+    uint16_t mask[2][8];
+    uint8_t base[16];     ///< subset << index bits, first palette entry of the subset of pixel k
+};
+
+// Palette of one channel: entry e = subset << index bits | index interpolates
+// the 2 endpoints of the subset with pmaddubsw
+struct alignas(16) PaletteLayout {
+    uint8_t select[2][64]; ///< endpoints of entry e for the channel in the low or high half of a vector
+    int8_t weight[64];     ///< 64 - w, w of entry e
+};
+
+// Layouts of the primary indices of each mode and partition, then of the
+// secondary indices of modes 4 and 5
+constexpr int index_offset[8] = {0, 16, 80, 144, 208, 209, 210, 211};
+constexpr int secondary_offset[8] = {0, 0, 0, 0, 275, 276, 0, 0};
+constexpr int index_layout_count = 277;
+
+struct Tables {
+    IndexLayout index[index_layout_count];
+    PaletteLayout palette[3][3]; ///< [subsets - 1][index bits - 2]
+
+    Tables() : index(), palette()
+    {
+        for (int mode = 0; mode < 8; ++mode) {
+            const ModeInfo& m = modes[mode];
+            for (int p = 0; p < (1 << m.partition_bits); ++p) {
+                MakeIndexLayout(index[index_offset[mode] + p], IndexStart(mode), m.index_bits, m.subsets, p);
+            }
+            if (m.index_bits2) {
+                MakeIndexLayout(index[secondary_offset[mode]], IndexStart(mode) + 16 * m.index_bits - 1, m.index_bits2, 1, 0);
+            }
+        }
+        for (int subsets = 1; subsets <= 3; ++subsets) {
+            for (int bits = 2; bits <= 4; ++bits) {
+                if ((subsets << bits) <= 32) {
+                    MakePaletteLayout(palette[subsets - 1][bits - 2], subsets, bits);
+                }
+            }
+        }
+    }
+
+    static void MakeIndexLayout(IndexLayout& l, int offset, int bits, int subsets, int partition)
+    {
+        for (int k = 0; k < 16; ++k) {
+            const int width = bits - (Anchor(subsets, partition, k) ? 1 : 0);
+            const int byte = offset / 8;
+            l.bytes[k / 8][2 * (k % 8)] = byte;
+            l.bytes[k / 8][2 * (k % 8) + 1] = byte < 15 ? byte + 1 : 0x80;
+            l.scale[k / 8][k % 8] = 1 << (7 - offset % 8);
+            l.mask[k / 8][k % 8] = (1 << width) - 1;
+            l.base[k] = Subset(subsets, partition, k) << bits;
+            offset += width;
+        }
+    }
+
+    static void MakePaletteLayout(PaletteLayout& l, int subsets, int bits)
+    {
+        for (int e = 0; e < 32; ++e) {
+            const bool used = e < (subsets << bits);
+            for (int half = 0; half < 2; ++half) {
+                l.select[half][2 * e] = used ? half * 8 + 2 * (e >> bits) : 0x80;
+                l.select[half][2 * e + 1] = used ? half * 8 + 2 * (e >> bits) + 1 : 0x80;
+            }
+            const int w = weights[bits - 2][e & ((1 << bits) - 1)];
+            l.weight[2 * e] = used ? 64 - w : 0;
+            l.weight[2 * e + 1] = used ? w : 0;
+        }
+    }
+};
+
+static const Tables& GetTables()
+{
+    static const Tables tables;
+    return tables;
+}
+
+// Unpacked fields of a batch of blocks
+constexpr int batch_size = 64;
+struct Batch {
+    alignas(16) uint8_t endpoints[batch_size][32]; ///< R, G, B and A of endpoints 0-5 at 0, 8, 16 and 24
+    uint8_t partition[batch_size];
+    uint8_t rotation[batch_size];
+    uint8_t selection[batch_size];
+};
+
+struct BitReader {
+    uint64_t low;
+    uint64_t high;
+    // n must be constant and in [1, 32] so that reads compile to fixed shifts
+    BC_SIMD_INLINE unsigned int read(int n)
+    {
+        const unsigned int bits = low & ((1u << n) - 1);
+        low = (low >> n) | (high << (64 - n));
+        high >>= n;
+        return bits;
+    }
+};
+
+template <int Mode>
+static BC_SIMD_INLINE void Unpack(const unsigned char* block, Batch& batch, int i)
+{
+    constexpr ModeInfo m = modes[Mode];
+    constexpr int endpoints = 2 * m.subsets;
+    BitReader bits;
+    std::memcpy(&bits.low, block, 8);
+    std::memcpy(&bits.high, block + 8, 8);
+    bits.read(Mode + 1);
+    batch.partition[i] = m.partition_bits ? bits.read(m.partition_bits) : 0;
+    batch.rotation[i] = m.rotation_bits ? bits.read(m.rotation_bits) : 0;
+    batch.selection[i] = m.selection_bits ? bits.read(m.selection_bits) : 0;
+
+    uint8_t* ep = batch.endpoints[i];
+    std::memset(ep, 0, sizeof(batch.endpoints[i]));
+    for (int c = 0; c < 3; ++c) {
+        for (int e = 0; e < endpoints; ++e) {
+            ep[c * 8 + e] = bits.read(m.color_bits);
+        }
+    }
+    if (m.alpha_bits) {
+        for (int e = 0; e < endpoints; ++e) {
+            ep[3 * 8 + e] = bits.read(m.alpha_bits);
+        }
+    }
+    if (m.pbits == 2) {
+        for (int e = 0; e < endpoints; ++e) {
+            const unsigned int p = bits.read(1);
+            for (int c = 0; c < 4; ++c) {
+                ep[c * 8 + e] = (ep[c * 8 + e] << 1) | p;
+            }
+        }
+    } else if (m.pbits == 1) {
+        for (int s = 0; s < m.subsets; ++s) {
+            const unsigned int p = bits.read(1);
+            for (int c = 0; c < 3; ++c) {
+                ep[c * 8 + 2 * s] = (ep[c * 8 + 2 * s] << 1) | p;
+                ep[c * 8 + 2 * s + 1] = (ep[c * 8 + 2 * s + 1] << 1) | p;
+            }
+        }
+    }
+}
+
+// Shift endpoints with `bits` of precision so that their MSB is bit 7 and
+// replicate the MSBs into the low bits
+template <int Bits>
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i ExpandEndpoints(__m128i x)
+{
+    x = _mm_slli_epi16(x, 8 - Bits);
+    return _mm_or_si128(x, _mm_srli_epi16(x, Bits));
+}
+
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i ExtractIndices(__m128i block, const IndexLayout& l)
+{
+    const __m128i* v = reinterpret_cast<const __m128i*>(&l);
+    const __m128i i0 = _mm_mullo_epi16(_mm_shuffle_epi8(block, _mm_load_si128(v + 0)), _mm_load_si128(v + 2));
+    const __m128i i1 = _mm_mullo_epi16(_mm_shuffle_epi8(block, _mm_load_si128(v + 1)), _mm_load_si128(v + 3));
+    return _mm_packus_epi16(_mm_and_si128(_mm_srli_epi16(i0, 7), _mm_load_si128(v + 4)),
+                            _mm_and_si128(_mm_srli_epi16(i1, 7), _mm_load_si128(v + 5)));
+}
+
+// Palette of the channel in half `half` of endpoints, entries 0-15 in pal[0]
+// and 16-31 in pal[1]
+template <int Entries>
+BC_SIMD_SSE41 static BC_SIMD_INLINE void Palette(__m128i endpoints, const PaletteLayout& l, int half, __m128i pal[2])
+{
+    const __m128i round = _mm_set1_epi16(32);
+    __m128i entries[4];
+    for (int g = 0; g < (Entries + 7) / 8; ++g) {
+        const __m128i e = _mm_shuffle_epi8(endpoints, _mm_load_si128(reinterpret_cast<const __m128i*>(l.select[half] + 16 * g)));
+        const __m128i w = _mm_load_si128(reinterpret_cast<const __m128i*>(l.weight + 16 * g));
+        entries[g] = _mm_srli_epi16(_mm_add_epi16(_mm_maddubs_epi16(e, w), round), 6);
+    }
+    pal[0] = _mm_packus_epi16(entries[0], Entries > 8 ? entries[1] : entries[0]);
+    if (Entries > 16) {
+        pal[1] = _mm_packus_epi16(entries[2], Entries > 24 ? entries[3] : entries[2]);
+    }
+}
+
+template <int Entries>
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Lookup(const __m128i pal[2], __m128i index)
+{
+    if (Entries <= 16) {
+        return _mm_shuffle_epi8(pal[0], index);
+    }
+    return _mm_blendv_epi8(_mm_shuffle_epi8(pal[0], index), _mm_shuffle_epi8(pal[1], index), _mm_cmpgt_epi8(index, _mm_set1_epi8(15)));
+}
+
+template <int Entries>
+BC_SIMD_SSE41 static BC_SIMD_INLINE void LookupRGB(__m128i rg, __m128i ba, const PaletteLayout& l, __m128i index, __m128i& r, __m128i& g, __m128i& b)
+{
+    __m128i pal[2];
+    Palette<Entries>(rg, l, 0, pal);
+    r = Lookup<Entries>(pal, index);
+    Palette<Entries>(rg, l, 1, pal);
+    g = Lookup<Entries>(pal, index);
+    Palette<Entries>(ba, l, 0, pal);
+    b = Lookup<Entries>(pal, index);
+}
+
+template <int Entries>
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i LookupAlpha(__m128i ba, const PaletteLayout& l, __m128i index)
+{
+    __m128i pal[2];
+    Palette<Entries>(ba, l, 1, pal);
+    return Lookup<Entries>(pal, index);
+}
+
+BC_SIMD_SSE41 static BC_SIMD_INLINE void StoreRGBA(__m128i r, __m128i g, __m128i b, __m128i a, unsigned char* dst, std::size_t pitch)
+{
+    const __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    const __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+    const __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    const __m128i ba_hi = _mm_unpackhi_epi8(b, a);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + pitch), _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * pitch), _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * pitch), _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+template <int Mode>
+BC_SIMD_SSE41 static BC_SIMD_INLINE void DecodeBlock(const Tables& t, const unsigned char* block, const Batch& batch, int i,
+                                                      unsigned char* dst, std::size_t pitch)
+{
+    constexpr ModeInfo m = modes[Mode];
+    constexpr int color_bits = m.color_bits + (m.pbits ? 1 : 0);
+    constexpr int alpha_bits = m.alpha_bits + (m.pbits ? 1 : 0);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+
+    // R and G endpoints in rg, B and A in ba, 8 bytes per channel
+    const __m128i* ep = reinterpret_cast<const __m128i*>(batch.endpoints[i]);
+    const __m128i rg = _mm_load_si128(ep);
+    const __m128i ba = _mm_load_si128(ep + 1);
+    const __m128i r16 = ExpandEndpoints<color_bits>(_mm_unpacklo_epi8(rg, zero));
+    const __m128i g16 = ExpandEndpoints<color_bits>(_mm_unpackhi_epi8(rg, zero));
+    const __m128i b16 = ExpandEndpoints<color_bits>(_mm_unpacklo_epi8(ba, zero));
+    const __m128i a16 = m.alpha_bits ? ExpandEndpoints<alpha_bits ? alpha_bits : 8>(_mm_unpackhi_epi8(ba, zero)) : _mm_set1_epi16(0xFF);
+    const __m128i rg8 = _mm_packus_epi16(r16, g16);
+    const __m128i ba8 = _mm_packus_epi16(b16, a16);
+
+    const IndexLayout& layout = t.index[index_offset[Mode] + batch.partition[i]];
+    const __m128i primary = _mm_add_epi8(ExtractIndices(raw, layout), _mm_load_si128(reinterpret_cast<const __m128i*>(layout.base)));
+    __m128i r, g, b, a;
+    if constexpr (m.index_bits2 == 0) {
+        constexpr int entries = m.subsets << m.index_bits;
+        const PaletteLayout& pl = t.palette[m.subsets - 1][m.index_bits - 2];
+        LookupRGB<entries>(rg8, ba8, pl, primary, r, g, b);
+        a = LookupAlpha<entries>(ba8, pl, primary);
+    } else {
+        // The index selection bit swaps which indices select color and alpha
+        constexpr int entries = 1 << m.index_bits;
+        constexpr int entries2 = 1 << m.index_bits2;
+        const PaletteLayout& pl = t.palette[0][m.index_bits - 2];
+        const PaletteLayout& pl2 = t.palette[0][m.index_bits2 - 2];
+        const __m128i secondary = ExtractIndices(raw, t.index[secondary_offset[Mode]]);
+        if (batch.selection[i]) {
+            LookupRGB<entries2>(rg8, ba8, pl2, secondary, r, g, b);
+            a = LookupAlpha<entries>(ba8, pl, primary);
+        } else {
+            LookupRGB<entries>(rg8, ba8, pl, primary, r, g, b);
+            a = LookupAlpha<entries2>(ba8, pl2, secondary);
+        }
+        switch (batch.rotation[i]) {
+            case 1: std::swap(a, r); break;
+            case 2: std::swap(a, g); break;
+            case 3: std::swap(a, b); break;
+        }
+    }
+    StoreRGBA(r, g, b, a, dst, pitch);
+}
+
+// Decode the blocks of mode Mode listed in blocks, src and dst point to block 0
+template <int Mode>
+BC_SIMD_SSE41 static void DecodeBatch(const Tables& t, const uint8_t* blocks, int count, const unsigned char* src,
+                                      unsigned char* dst, std::size_t pitch)
+{
+    Batch batch;
+    for (int i = 0; i < count; ++i) {
+        Unpack<Mode>(src + blocks[i] * 16, batch, i);
+    }
+    for (int i = 0; i < count; ++i) {
+        DecodeBlock<Mode>(t, src + blocks[i] * 16, batch, i, dst + blocks[i] * 16, pitch);
+    }
+}
+
+} // namespace bc7
+
+BC_SIMD_SSE41 static std::size_t DecodeBlocksBC7_SSE41(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    using namespace bc7;
+    const Tables& t = GetTables();
+    for (std::size_t first = 0; first < count; first += batch_size) {
+        const int n = static_cast<int>(std::min<std::size_t>(batch_size, count - first));
+        const unsigned char* batch_src = src + first * 16;
+        unsigned char* batch_dst = dst + first * 16;
+
+        // Mode is the number of 0 bits before the first 1, 8 is invalid
+        uint8_t blocks[9][batch_size];
+        int counts[9] = {};
+        for (int i = 0; i < n; ++i) {
+            const unsigned int byte = batch_src[i * 16];
+            const int mode = byte ? __builtin_ctz(byte) : 8;
+            blocks[mode][counts[mode]++] = i;
+        }
+        DecodeBatch<0>(t, blocks[0], counts[0], batch_src, batch_dst, pitch);
+        DecodeBatch<1>(t, blocks[1], counts[1], batch_src, batch_dst, pitch);
+        DecodeBatch<2>(t, blocks[2], counts[2], batch_src, batch_dst, pitch);
+        DecodeBatch<3>(t, blocks[3], counts[3], batch_src, batch_dst, pitch);
+        DecodeBatch<4>(t, blocks[4], counts[4], batch_src, batch_dst, pitch);
+        DecodeBatch<5>(t, blocks[5], counts[5], batch_src, batch_dst, pitch);
+        DecodeBatch<6>(t, blocks[6], counts[6], batch_src, batch_dst, pitch);
+        DecodeBatch<7>(t, blocks[7], counts[7], batch_src, batch_dst, pitch);
+        // invalid blocks are transparent black
+        for (int i = 0; i < counts[8]; ++i) {
+            for (int r = 0; r < 4; ++r) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(batch_dst + blocks[8][i] * 16 + r * pitch), _mm_setzero_si128());
+            }
+        }
+    }
+    return count;
+}
+
+} // namespace bc_simd
+
+#endif // BC_SIMD_X86
@@ -0,0 +1,425 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// SIMD decoders for BC1, BC2 and BC3 that decode several horizontally adjacent
+// blocks per iteration. Endpoints are expanded and palettes interpolated for 4
+// (SSE4.1) or 8 (AVX2) blocks at once, then the 2-bit and 3-bit indices are
+// resolved with byte shuffles. The output is bit-exact with bcdec.
+//
+// DecodeBlocks*() decode the largest multiple of 4 or 8 blocks from count
+// blocks of a block row into dst and return how many blocks were decoded; the
+// caller decodes the remaining blocks with bcdec.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BC_SIMD_X86 1
+
+#include <immintrin.h>
+
+#define BC_SIMD_SSE41 __attribute__((target("sse4.1")))
+#define BC_SIMD_AVX2 __attribute__((target("avx2")))
+#define BC_SIMD_INLINE inline __attribute__((always_inline))
+
+namespace bc_simd {
+
+// pshufb masks selecting the palette entries of a row of 4 pixels from the
+// byte holding their 2-bit indices
+struct ColorShuffle {
+    alignas(16) unsigned char mask[256][16];
+    constexpr ColorShuffle() : mask() {
+        for (int i = 0; i < 256; ++i) {
+            for (int p = 0; p < 4; ++p) {
+                for (int c = 0; c < 4; ++c) {
+                    mask[i][p * 4 + c] = ((i >> (2 * p)) & 3) * 4 + c;
+                }
+            }
+        }
+    }
+};
+static constexpr ColorShuffle color_shuffle;
+
+// Expand 5 and 6 bit channels to 8 bits like bcdec: (x * 527 + 23) >> 6 and
+// (x * 259 + 33) >> 6. Products fit in 16 bits so a 16-bit multiply is enough.
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Expand5(__m128i x)
+{
+    return _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi16(x, _mm_set1_epi32(527)), _mm_set1_epi32(23)), 6);
+}
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Expand6(__m128i x)
+{
+    return _mm_srli_epi32(_mm_add_epi32(_mm_mullo_epi16(x, _mm_set1_epi32(259)), _mm_set1_epi32(33)), 6);
+}
+// x / 3 for x < 2^16 in 32-bit lanes: (x * 0xAAAB) >> 17
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Div3(__m128i x)
+{
+    return _mm_srli_epi32(_mm_mulhi_epu16(x, _mm_set1_epi32(0xAAAB)), 1);
+}
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i PackRGB(__m128i r, __m128i g, __m128i b)
+{
+    return _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(b, 16), _mm_set1_epi32(0xFF000000)));
+}
+
+// Transpose 4 vectors of 4 dwords: in[e][k] becomes out[k][e]
+BC_SIMD_SSE41 static BC_SIMD_INLINE void Transpose4(const __m128i in[4], __m128i out[4])
+{
+    const __m128i t0 = _mm_unpacklo_epi32(in[0], in[1]);
+    const __m128i t1 = _mm_unpacklo_epi32(in[2], in[3]);
+    const __m128i t2 = _mm_unpackhi_epi32(in[0], in[1]);
+    const __m128i t3 = _mm_unpackhi_epi32(in[2], in[3]);
+    out[0] = _mm_unpacklo_epi64(t0, t1);
+    out[1] = _mm_unpackhi_epi64(t0, t1);
+    out[2] = _mm_unpacklo_epi64(t2, t3);
+    out[3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+// 4 entries RGBA palettes of 4 color blocks, colors holds c0 | c1 << 16 of
+// each block. palette[k] is the palette of block k.
+BC_SIMD_SSE41 static BC_SIMD_INLINE void ColorPalettes(__m128i colors, bool only_opaque, __m128i palette[4])
+{
+    const __m128i mask5 = _mm_set1_epi32(0x1F);
+    const __m128i mask6 = _mm_set1_epi32(0x3F);
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i c0 = _mm_and_si128(colors, _mm_set1_epi32(0xFFFF));
+    const __m128i c1 = _mm_srli_epi32(colors, 16);
+
+    const __m128i r0 = Expand5(_mm_and_si128(_mm_srli_epi32(c0, 11), mask5));
+    const __m128i g0 = Expand6(_mm_and_si128(_mm_srli_epi32(c0, 5), mask6));
+    const __m128i b0 = Expand5(_mm_and_si128(c0, mask5));
+    const __m128i r1 = Expand5(_mm_and_si128(_mm_srli_epi32(c1, 11), mask5));
+    const __m128i g1 = Expand6(_mm_and_si128(_mm_srli_epi32(c1, 5), mask6));
+    const __m128i b1 = Expand5(_mm_and_si128(c1, mask5));
+
+    // color_2 = 2/3*color_0 + 1/3*color_1, color_3 = 1/3*color_0 + 2/3*color_1
+    const __m128i r01 = _mm_add_epi32(_mm_add_epi32(r0, r1), one);
+    const __m128i g01 = _mm_add_epi32(_mm_add_epi32(g0, g1), one);
+    const __m128i b01 = _mm_add_epi32(_mm_add_epi32(b0, b1), one);
+    __m128i entries[4];
+    entries[0] = PackRGB(r0, g0, b0);
+    entries[1] = PackRGB(r1, g1, b1);
+    entries[2] = PackRGB(Div3(_mm_add_epi32(r01, r0)), Div3(_mm_add_epi32(g01, g0)), Div3(_mm_add_epi32(b01, b0)));
+    entries[3] = PackRGB(Div3(_mm_add_epi32(r01, r1)), Div3(_mm_add_epi32(g01, g1)), Div3(_mm_add_epi32(b01, b1)));
+    if (!only_opaque) {
+        // BC1A mode when c0 <= c1: color_2 = 1/2*color_0 + 1/2*color_1, color_3 = 0
+        const __m128i opaque = _mm_cmpgt_epi32(c0, c1);
+        const __m128i half = PackRGB(_mm_srli_epi32(r01, 1), _mm_srli_epi32(g01, 1), _mm_srli_epi32(b01, 1));
+        entries[2] = _mm_blendv_epi8(half, entries[2], opaque);
+        entries[3] = _mm_and_si128(entries[3], opaque);
+    }
+    Transpose4(entries, palette);
+}
+
+// Write the 4 rows of a color block. alpha holds the 16 alpha values of the
+// block in pixel order and replaces the alpha of the palette when has_alpha.
+BC_SIMD_SSE41 static BC_SIMD_INLINE void StoreColorRows(__m128i palette, uint32_t indices, bool has_alpha, __m128i alpha,
+                                                         unsigned char* dst, std::size_t pitch)
+{
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+    for (int r = 0; r < 4; ++r) {
+        const __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(color_shuffle.mask[(indices >> (8 * r)) & 0xFF]));
+        __m128i row = _mm_shuffle_epi8(palette, shuffle);
+        if (has_alpha) {
+            // move alpha of pixels 4r..4r+3 to byte 3 of each pixel
+            const char a = static_cast<char>(4 * r);
+            const __m128i spread = _mm_setr_epi8(-1, -1, -1, a, -1, -1, -1, a + 1, -1, -1, -1, a + 2, -1, -1, -1, a + 3);
+            row = _mm_or_si128(_mm_and_si128(row, rgb_mask), _mm_shuffle_epi8(alpha, spread));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + r * pitch), row);
+    }
+}
+
+// 16 4-bit alpha of a BC2 block to bytes in pixel order, scaled by 17 like bcdec
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i SharpAlpha(const unsigned char* block)
+{
+    const __m128i a = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(block));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i n = _mm_unpacklo_epi8(_mm_and_si128(a, nibble), _mm_and_si128(_mm_srli_epi16(a, 4), nibble));
+    return _mm_or_si128(n, _mm_slli_epi16(n, 4));
+}
+
+// x / 7 for x <= 7 * 255 + 1 and x / 5 for x <= 5 * 255 + 1 in 32-bit lanes
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Div7(__m128i x)
+{
+    return _mm_mulhi_epu16(x, _mm_set1_epi32(9363));
+}
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i Div5(__m128i x)
+{
+    return _mm_mulhi_epu16(x, _mm_set1_epi32(13108));
+}
+
+// 8 entries alpha palettes of 4 BC3 alpha blocks, endpoints holds the first
+// dword of each block. Returns the palettes of blocks 0 and 1 in palette01 and
+// of blocks 2 and 3 in palette23, 8 bytes per block.
+BC_SIMD_SSE41 static BC_SIMD_INLINE void AlphaPalettes(__m128i endpoints, __m128i& palette01, __m128i& palette23)
+{
+    const __m128i a0 = _mm_and_si128(endpoints, _mm_set1_epi32(0xFF));
+    const __m128i a1 = _mm_and_si128(_mm_srli_epi32(endpoints, 8), _mm_set1_epi32(0xFF));
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i six = _mm_cmpgt_epi32(a0, a1); // 6 interpolated values, else 4
+    __m128i e[8];
+    e[0] = a0;
+    e[1] = a1;
+    for (int k = 2; k < 6; ++k) {
+        const __m128i t7 = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(a0, _mm_set1_epi32(8 - k)), _mm_mullo_epi16(a1, _mm_set1_epi32(k - 1))), one);
+        const __m128i t5 = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(a0, _mm_set1_epi32(6 - k)), _mm_mullo_epi16(a1, _mm_set1_epi32(k - 1))), one);
+        e[k] = _mm_blendv_epi8(Div5(t5), Div7(t7), six);
+    }
+    for (int k = 6; k < 8; ++k) {
+        const __m128i t7 = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi16(a0, _mm_set1_epi32(8 - k)), _mm_mullo_epi16(a1, _mm_set1_epi32(k - 1))), one);
+        e[k] = _mm_blendv_epi8(_mm_set1_epi32(k == 6 ? 0x00 : 0xFF), Div7(t7), six);
+    }
+    // bytes e0[0..3] e1[0..3] e2[0..3] e3[0..3], then transpose to blocks
+    const __m128i q0 = _mm_packus_epi16(_mm_packs_epi32(e[0], e[1]), _mm_packs_epi32(e[2], e[3]));
+    const __m128i q1 = _mm_packus_epi16(_mm_packs_epi32(e[4], e[5]), _mm_packs_epi32(e[6], e[7]));
+    const __m128i transpose = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m128i t0 = _mm_shuffle_epi8(q0, transpose);
+    const __m128i t1 = _mm_shuffle_epi8(q1, transpose);
+    palette01 = _mm_unpacklo_epi32(t0, t1);
+    palette23 = _mm_unpackhi_epi32(t0, t1);
+}
+
+// Resolve the 16 3-bit indices of a BC3 alpha block with its palette (in the
+// low 8 bytes of palette), alpha values are returned in pixel order
+BC_SIMD_SSE41 static BC_SIMD_INLINE __m128i SmoothAlpha(__m128i block, __m128i palette)
+{
+    // Index k is at bit 16 + 3k of the block: gather the 2 bytes holding it
+    // in 16-bit lane k, shift it to bit 7 with a multiply and mask it.
+    const __m128i bytes0 = _mm_setr_epi8(2, 3, 2, 3, 2, 3, 3, 4, 3, 4, 3, 4, 4, 5, 4, 5);
+    const __m128i bytes1 = _mm_setr_epi8(5, 6, 5, 6, 5, 6, 6, 7, 6, 7, 6, 7, 7, 8, 7, 8);
+    const __m128i shift = _mm_setr_epi16(128, 16, 2, 64, 8, 1, 32, 4); // 1 << (7 - (3k % 8))
+    const __m128i mask = _mm_set1_epi16(7);
+    const __m128i i0 = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(block, bytes0), shift), 7), mask);
+    const __m128i i1 = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(block, bytes1), shift), 7), mask);
+    return _mm_shuffle_epi8(palette, _mm_packus_epi16(i0, i1));
+}
+
+// Dwords d of 4 consecutive 16 bytes blocks
+BC_SIMD_SSE41 static BC_SIMD_INLINE void BlockDwords(const __m128i block[4], __m128i& d0, __m128i& d1, __m128i& d2, __m128i& d3)
+{
+    __m128i d[4];
+    Transpose4(block, d);
+    d0 = d[0];
+    d1 = d[1];
+    d2 = d[2];
+    d3 = d[3];
+}
+
+BC_SIMD_SSE41 static BC_SIMD_INLINE void DecodeColorBlocks(const __m128i palette[4], __m128i indices, const __m128i alpha[4], bool has_alpha,
+                                                            unsigned char* dst, std::size_t pitch)
+{
+    alignas(16) uint32_t index[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(index), indices);
+    for (int k = 0; k < 4; ++k) {
+        StoreColorRows(palette[k], index[k], has_alpha, has_alpha ? alpha[k] : _mm_setzero_si128(), dst + k * 16, pitch);
+    }
+}
+
+// SSE4.1, 4 blocks per iteration //////////////////////////////////////////////
+BC_SIMD_SSE41 static std::size_t DecodeBlocksBC1_SSE41(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 4 * 4;
+    for (std::size_t i = 0; i < n; i += 4, src += 4 * 8, dst += 4 * 16) {
+        const __m128 b01 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+        const __m128 b23 = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16)));
+        const __m128i colors = _mm_castps_si128(_mm_shuffle_ps(b01, b23, _MM_SHUFFLE(2, 0, 2, 0)));
+        const __m128i indices = _mm_castps_si128(_mm_shuffle_ps(b01, b23, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i palette[4];
+        ColorPalettes(colors, false, palette);
+        DecodeColorBlocks(palette, indices, nullptr, false, dst, pitch);
+    }
+    return n;
+}
+
+BC_SIMD_SSE41 static std::size_t DecodeBlocksBC2_SSE41(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 4 * 4;
+    for (std::size_t i = 0; i < n; i += 4, src += 4 * 16, dst += 4 * 16) {
+        __m128i block[4], alpha[4], d0, d1, colors, indices;
+        for (int k = 0; k < 4; ++k) {
+            block[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k));
+            alpha[k] = SharpAlpha(src + 16 * k);
+        }
+        BlockDwords(block, d0, d1, colors, indices);
+        __m128i palette[4];
+        ColorPalettes(colors, true, palette);
+        DecodeColorBlocks(palette, indices, alpha, true, dst, pitch);
+    }
+    return n;
+}
+
+BC_SIMD_SSE41 static std::size_t DecodeBlocksBC3_SSE41(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 4 * 4;
+    for (std::size_t i = 0; i < n; i += 4, src += 4 * 16, dst += 4 * 16) {
+        __m128i block[4], alpha[4], endpoints, d1, colors, indices, palette01, palette23;
+        for (int k = 0; k < 4; ++k) {
+            block[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k));
+        }
+        BlockDwords(block, endpoints, d1, colors, indices);
+        AlphaPalettes(endpoints, palette01, palette23);
+        alpha[0] = SmoothAlpha(block[0], palette01);
+        alpha[1] = SmoothAlpha(block[1], _mm_srli_si128(palette01, 8));
+        alpha[2] = SmoothAlpha(block[2], palette23);
+        alpha[3] = SmoothAlpha(block[3], _mm_srli_si128(palette23, 8));
+        __m128i palette[4];
+        ColorPalettes(colors, true, palette);
+        DecodeColorBlocks(palette, indices, alpha, true, dst, pitch);
+    }
+    return n;
+}
+
+// AVX2, 8 blocks per iteration ////////////////////////////////////////////////
+// Palettes of 8 blocks are computed in 256-bit registers, indices are then
+// resolved per block like the SSE4.1 decoders.
+BC_SIMD_AVX2 static BC_SIMD_INLINE __m256i Expand5x8(__m256i x)
+{
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi16(x, _mm256_set1_epi32(527)), _mm256_set1_epi32(23)), 6);
+}
+BC_SIMD_AVX2 static BC_SIMD_INLINE __m256i Expand6x8(__m256i x)
+{
+    return _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi16(x, _mm256_set1_epi32(259)), _mm256_set1_epi32(33)), 6);
+}
+BC_SIMD_AVX2 static BC_SIMD_INLINE __m256i Div3x8(__m256i x)
+{
+    return _mm256_srli_epi32(_mm256_mulhi_epu16(x, _mm256_set1_epi32(0xAAAB)), 1);
+}
+BC_SIMD_AVX2 static BC_SIMD_INLINE __m256i PackRGBx8(__m256i r, __m256i g, __m256i b)
+{
+    return _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(b, 16), _mm256_set1_epi32(0xFF000000)));
+}
+
+// Same as ColorPalettes() for 8 blocks, palette[k] is the palette of block k
+BC_SIMD_AVX2 static BC_SIMD_INLINE void ColorPalettesx8(__m256i colors, bool only_opaque, __m128i palette[8])
+{
+    const __m256i mask5 = _mm256_set1_epi32(0x1F);
+    const __m256i mask6 = _mm256_set1_epi32(0x3F);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i c0 = _mm256_and_si256(colors, _mm256_set1_epi32(0xFFFF));
+    const __m256i c1 = _mm256_srli_epi32(colors, 16);
+
+    const __m256i r0 = Expand5x8(_mm256_and_si256(_mm256_srli_epi32(c0, 11), mask5));
+    const __m256i g0 = Expand6x8(_mm256_and_si256(_mm256_srli_epi32(c0, 5), mask6));
+    const __m256i b0 = Expand5x8(_mm256_and_si256(c0, mask5));
+    const __m256i r1 = Expand5x8(_mm256_and_si256(_mm256_srli_epi32(c1, 11), mask5));
+    const __m256i g1 = Expand6x8(_mm256_and_si256(_mm256_srli_epi32(c1, 5), mask6));
+    const __m256i b1 = Expand5x8(_mm256_and_si256(c1, mask5));
+
+    const __m256i r01 = _mm256_add_epi32(_mm256_add_epi32(r0, r1), one);
+    const __m256i g01 = _mm256_add_epi32(_mm256_add_epi32(g0, g1), one);
+    const __m256i b01 = _mm256_add_epi32(_mm256_add_epi32(b0, b1), one);
+    __m256i entries[4];
+    entries[0] = PackRGBx8(r0, g0, b0);
+    entries[1] = PackRGBx8(r1, g1, b1);
+    entries[2] = PackRGBx8(Div3x8(_mm256_add_epi32(r01, r0)), Div3x8(_mm256_add_epi32(g01, g0)), Div3x8(_mm256_add_epi32(b01, b0)));
+    entries[3] = PackRGBx8(Div3x8(_mm256_add_epi32(r01, r1)), Div3x8(_mm256_add_epi32(g01, g1)), Div3x8(_mm256_add_epi32(b01, b1)));
+    if (!only_opaque) {
+        const __m256i opaque = _mm256_cmpgt_epi32(c0, c1);
+        const __m256i half = PackRGBx8(_mm256_srli_epi32(r01, 1), _mm256_srli_epi32(g01, 1), _mm256_srli_epi32(b01, 1));
+        entries[2] = _mm256_blendv_epi8(half, entries[2], opaque);
+        entries[3] = _mm256_and_si256(entries[3], opaque);
+    }
+
+    // Transpose in each 128-bit lane: blocks 0-3 in the low lane, 4-7 in the high one
+    const __m256i t0 = _mm256_unpacklo_epi32(entries[0], entries[1]);
+    const __m256i t1 = _mm256_unpacklo_epi32(entries[2], entries[3]);
+    const __m256i t2 = _mm256_unpackhi_epi32(entries[0], entries[1]);
+    const __m256i t3 = _mm256_unpackhi_epi32(entries[2], entries[3]);
+    const __m256i p0 = _mm256_unpacklo_epi64(t0, t1);
+    const __m256i p1 = _mm256_unpackhi_epi64(t0, t1);
+    const __m256i p2 = _mm256_unpacklo_epi64(t2, t3);
+    const __m256i p3 = _mm256_unpackhi_epi64(t2, t3);
+    palette[0] = _mm256_castsi256_si128(p0);
+    palette[1] = _mm256_castsi256_si128(p1);
+    palette[2] = _mm256_castsi256_si128(p2);
+    palette[3] = _mm256_castsi256_si128(p3);
+    palette[4] = _mm256_extracti128_si256(p0, 1);
+    palette[5] = _mm256_extracti128_si256(p1, 1);
+    palette[6] = _mm256_extracti128_si256(p2, 1);
+    palette[7] = _mm256_extracti128_si256(p3, 1);
+}
+
+BC_SIMD_AVX2 static std::size_t DecodeBlocksBC1_AVX2(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 8 * 8;
+    for (std::size_t i = 0; i < n; i += 8, src += 8 * 8, dst += 8 * 16) {
+        const __m256 b0 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src)));
+        const __m256 b1 = _mm256_castsi256_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 32)));
+        // in lane order the shuffle gives blocks 0 1 4 5 | 2 3 6 7
+        const __m256i colors = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0));
+        const __m256i indices = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i palette[8];
+        ColorPalettesx8(colors, false, palette);
+        DecodeColorBlocks(palette, _mm256_castsi256_si128(indices), nullptr, false, dst, pitch);
+        DecodeColorBlocks(palette + 4, _mm256_extracti128_si256(indices, 1), nullptr, false, dst + 4 * 16, pitch);
+    }
+    return n;
+}
+
+BC_SIMD_AVX2 static std::size_t DecodeBlocksBC2_AVX2(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 8 * 8;
+    for (std::size_t i = 0; i < n; i += 8, src += 8 * 16, dst += 8 * 16) {
+        __m128i block[8], alpha[8], d0, d1, colors[2], indices[2];
+        for (int k = 0; k < 8; ++k) {
+            block[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k));
+            alpha[k] = SharpAlpha(src + 16 * k);
+        }
+        BlockDwords(block, d0, d1, colors[0], indices[0]);
+        BlockDwords(block + 4, d0, d1, colors[1], indices[1]);
+        __m128i palette[8];
+        ColorPalettesx8(_mm256_set_m128i(colors[1], colors[0]), true, palette);
+        DecodeColorBlocks(palette, indices[0], alpha, true, dst, pitch);
+        DecodeColorBlocks(palette + 4, indices[1], alpha + 4, true, dst + 4 * 16, pitch);
+    }
+    return n;
+}
+
+BC_SIMD_AVX2 static std::size_t DecodeBlocksBC3_AVX2(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count)
+{
+    const std::size_t n = count / 8 * 8;
+    for (std::size_t i = 0; i < n; i += 8, src += 8 * 16, dst += 8 * 16) {
+        __m128i block[8], alpha[8], endpoints[2], d1, colors[2], indices[2], palette01, palette23;
+        for (int k = 0; k < 8; ++k) {
+            block[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16 * k));
+        }
+        BlockDwords(block, endpoints[0], d1, colors[0], indices[0]);
+        BlockDwords(block + 4, endpoints[1], d1, colors[1], indices[1]);
+        for (int h = 0; h < 2; ++h) {
+            AlphaPalettes(endpoints[h], palette01, palette23);
+            alpha[4 * h + 0] = SmoothAlpha(block[4 * h + 0], palette01);
+            alpha[4 * h + 1] = SmoothAlpha(block[4 * h + 1], _mm_srli_si128(palette01, 8));
+            alpha[4 * h + 2] = SmoothAlpha(block[4 * h + 2], palette23);
+            alpha[4 * h + 3] = SmoothAlpha(block[4 * h + 3], _mm_srli_si128(palette23, 8));
+        }
+        __m128i palette[8];
+        ColorPalettesx8(_mm256_set_m128i(colors[1], colors[0]), true, palette);
+        DecodeColorBlocks(palette, indices[0], alpha, true, dst, pitch);
+        DecodeColorBlocks(palette + 4, indices[1], alpha + 4, true, dst + 4 * 16, pitch);
+    }
+    return n;
+}
+
+} // namespace bc_simd
+
+#endif // x86
@@ -0,0 +1,58 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Stages of DDSCreator::create() timed by dds_bench. When the plugin is
+// compiled into the benchmark with DDS_THUMBNAILER_BENCH, create() calls
+// BENCH_START() on entry and BENCH_LAP() at the end of each stage; otherwise
+// the macros expand to nothing.
+
+#pragma once
+
+#include <chrono>
+
+enum BenchStage {
+    BenchOpen,   ///< open the file and check the headers
+    BenchSetup,  ///< options and plan: mip level, reduction or sampling
+    BenchDecode, ///< decode and convert or tone map, reduce or sample into the QImage
+    BenchStageCount
+};
+
+struct BenchStageTimes {
+    std::chrono::steady_clock::time_point last;
+    double seconds[BenchStageCount] = {};
+};
+
+// Times of the last create() call, the benchmark runs it on one thread
+inline BenchStageTimes bench_stage_times;
+
+inline const char* BenchStageName(int stage)
+{
+    static const char* const names[BenchStageCount] = {"open", "setup", "decode"};
+    return names[stage];
+}
+
+#define BENCH_START() (bench_stage_times = BenchStageTimes{std::chrono::steady_clock::now(), {}})
+#define BENCH_LAP(stage) do { \
+        const auto bench_now = std::chrono::steady_clock::now(); \
+        bench_stage_times.seconds[stage] += std::chrono::duration<double>(bench_now - bench_stage_times.last).count(); \
+        bench_stage_times.last = bench_now; \
+    } while (false)
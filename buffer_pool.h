@@ -0,0 +1,157 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+
+#include <sys/mman.h>
+
+// Buffers of decoded images reused from one thumbnail to the next. A large
+// image allocated and freed per file is mapped, page faulted and zeroed by the
+// kernel each time and unmapped right after by the allocator; released
+// buffers are kept instead and handed to the next acquire() that fits them
+// without wasting more than half of the buffer.
+// Buffers of at least huge_page_size can be backed by transparent huge pages.
+// At most max_cached bytes are kept: past that high-water mark the least
+// recently released buffers are freed. The pool is shared by threads, a
+// buffer may be released by another thread than the one that acquired it.
+// Buffers find their pool through their header, so the pool must outlive
+// every buffer it handed out.
+class BufferPool
+{
+    public:
+        static constexpr std::size_t alignment = 64;
+        static constexpr std::size_t huge_page_size = 2 << 20;
+
+        BufferPool(std::size_t max_cached, bool huge_pages) : max_cached(max_cached), huge_pages(huge_pages) {}
+        ~BufferPool() {trim(0);}
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        // Buffer of at least size bytes aligned to alignment, nullptr if it
+        // could not be allocated. The content is undefined.
+        void* acquire(std::size_t size);
+        // Give back a buffer of acquire(), of any pool. The signature is the
+        // one of a QImageCleanupFunction.
+        static void Release(void* buffer);
+        // Free released buffers until at most max bytes are kept
+        void trim(std::size_t max);
+
+    private:
+        // Stored in the alignment bytes in front of each buffer
+        struct Header {
+            BufferPool* pool;
+            std::size_t capacity; ///< bytes usable after the header
+        };
+
+        static Header* HeaderOf(void* buffer) {return reinterpret_cast<Header*>(static_cast<uint8_t*>(buffer) - alignment);}
+        void* allocate(std::size_t size);
+        void release(void* buffer);
+        void shrink(std::size_t max); // with mutex locked
+
+        std::mutex mutex;
+        std::deque<void*> released; // least recently released first
+        std::size_t cached = 0;     // capacity of the released buffers
+        const std::size_t max_cached;
+        const bool huge_pages;
+};
+
+inline void* BufferPool::acquire(std::size_t size)
+{
+    {
+        // best fit: a larger buffer is already paged in, only its start is
+        // used. One over twice the size would pin memory a small image never
+        // touches, a fresh buffer is allocated instead.
+        std::lock_guard<std::mutex> lock(mutex);
+        auto best = released.end();
+        for (auto it = released.begin(); it != released.end(); ++it) {
+            const std::size_t capacity = HeaderOf(*it)->capacity;
+            if (capacity >= size && capacity / 2 <= size && (best == released.end() || capacity < HeaderOf(*best)->capacity)) {
+                best = it;
+            }
+        }
+        if (best != released.end()) {
+            void* buffer = *best;
+            released.erase(best);
+            cached -= HeaderOf(buffer)->capacity;
+            return buffer;
+        }
+    }
+    return allocate(size);
+}
+
+inline void* BufferPool::allocate(std::size_t size)
+{
+    const bool huge = huge_pages && size >= huge_page_size;
+    const std::size_t block_alignment = huge ? huge_page_size : alignment;
+    if (size > SIZE_MAX - alignment - block_alignment) {
+        return nullptr;
+    }
+    const std::size_t block_size = (size + alignment + block_alignment - 1) / block_alignment * block_alignment;
+    void* block = std::aligned_alloc(block_alignment, block_size);
+    if (!block) {
+        return nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge) {
+        madvise(block, block_size, MADV_HUGEPAGE);
+    }
+#endif
+    *static_cast<Header*>(block) = {this, block_size - alignment};
+    return static_cast<uint8_t*>(block) + alignment;
+}
+
+inline void BufferPool::Release(void* buffer)
+{
+    if (buffer) {
+        HeaderOf(buffer)->pool->release(buffer);
+    }
+}
+
+inline void BufferPool::release(void* buffer)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    released.push_back(buffer);
+    cached += HeaderOf(buffer)->capacity;
+    shrink(max_cached);
+}
+
+inline void BufferPool::trim(std::size_t max)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    shrink(max);
+}
+
+inline void BufferPool::shrink(std::size_t max)
+{
+    while (cached > max) {
+        void* oldest = released.front();
+        released.pop_front();
+        cached -= HeaderOf(oldest)->capacity;
+        std::free(HeaderOf(oldest));
+    }
+}
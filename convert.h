@@ -0,0 +1,315 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Conversion of a row of decoded or uncompressed pixels to the QImage format
+// of the texture (see bc_table and uncompressed_table). Converters that do
+// more than a copy have SSE2, AVX2 and AVX-512BW loops, picked per row by
+// CpuIsa(); the scalar loop handles the remaining pixels. Copies are left to
+// memcpy, which has its own dispatch.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_isa.h"
+
+#ifdef CPU_ISA_X86
+#include <immintrin.h>
+#define CONVERT_SSE2 __attribute__((target("sse2")))
+#define CONVERT_AVX2 __attribute__((target("avx2")))
+#define CONVERT_AVX512BW __attribute__((target("avx512f,avx512bw")))
+#endif
+
+typedef void (*PFN_Convert)(uint8_t* line_dst, const uint8_t* line_src, std::size_t width);
+
+// Converts the first pixels of a row with SIMD and returns how many it did
+typedef std::size_t (*PFN_ConvertSimd)(uint8_t* line_dst, const uint8_t* line_src, std::size_t width);
+
+// Run the SIMD loop of the selected instruction set level
+template <PFN_ConvertSimd SSE2, PFN_ConvertSimd AVX2, PFN_ConvertSimd AVX512BW>
+static inline std::size_t ConvertSimd(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    switch (CpuIsa()) {
+        case Isa::AVX512BW: return AVX512BW(line_dst, line_src, width);
+        case Isa::AVX2:     return AVX2(line_dst, line_src, width);
+        case Isa::SSE41:
+        case Isa::SSE2:     return SSE2(line_dst, line_src, width);
+        case Isa::Generic:  break;
+    }
+    return 0;
+}
+
+static inline void Convert_NOOP8(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::memcpy(line_dst, line_src, width*1);
+}
+static inline void Convert_NOOP16(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::memcpy(line_dst, line_src, width*2);
+}
+static inline void Convert_NOOP24(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::memcpy(line_dst, line_src, width*3);
+}
+static inline void Convert_NOOP32(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::memcpy(line_dst, line_src, width*4);
+}
+static inline void Convert_NOOP64(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::memcpy(line_dst, line_src, width*8);
+}
+
+#ifdef CPU_ISA_X86
+// RG88 to RGBA8888: zero extend each 16 bit pixel to 32 bits and set alpha
+CONVERT_SSE2 static std::size_t RG88_SSE2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const __m128i rg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line_src + 2 * j));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(line_dst + 4 * j), _mm_or_si128(_mm_unpacklo_epi16(rg, zero), alpha));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(line_dst + 4 * j + 16), _mm_or_si128(_mm_unpackhi_epi16(rg, zero), alpha));
+    }
+    return j;
+}
+CONVERT_AVX2 static std::size_t RG88_AVX2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const __m128i rg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line_src + 2 * j));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(line_dst + 4 * j), _mm256_or_si256(_mm256_cvtepu16_epi32(rg), alpha));
+    }
+    return j;
+}
+CONVERT_AVX512BW static std::size_t RG88_AVX512BW(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m512i alpha = _mm512_set1_epi32(0xff000000);
+    const __mmask16 all = 0xffff; // see RGB10A2_AVX512BW
+    std::size_t j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const __m256i rg = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line_src + 2 * j));
+        _mm512_storeu_si512(line_dst + 4 * j, _mm512_or_si512(_mm512_maskz_cvtepu16_epi32(all, rg), alpha));
+    }
+    return j;
+}
+
+// AND each 16 bit pixel with Mask
+template <uint16_t Mask>
+CONVERT_SSE2 static std::size_t Mask16_SSE2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m128i m = _mm_set1_epi16(Mask);
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line_src + 2 * j));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(line_dst + 2 * j), _mm_and_si128(v, m));
+    }
+    return j;
+}
+template <uint16_t Mask>
+CONVERT_AVX2 static std::size_t Mask16_AVX2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m256i m = _mm256_set1_epi16(Mask);
+    std::size_t j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line_src + 2 * j));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(line_dst + 2 * j), _mm256_and_si256(v, m));
+    }
+    return j;
+}
+template <uint16_t Mask>
+CONVERT_AVX512BW static std::size_t Mask16_AVX512BW(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m512i m = _mm512_set1_epi16(Mask);
+    std::size_t j = 0;
+    for (; j + 32 <= width; j += 32) {
+        const __m512i v = _mm512_loadu_si512(line_src + 2 * j);
+        _mm512_storeu_si512(line_dst + 2 * j, _mm512_and_si512(v, m));
+    }
+    return j;
+}
+
+// Set the alpha byte of each 32 bit pixel
+CONVERT_SSE2 static std::size_t XRGB32_SSE2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    std::size_t j = 0;
+    for (; j + 4 <= width; j += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line_src + 4 * j));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(line_dst + 4 * j), _mm_or_si128(v, alpha));
+    }
+    return j;
+}
+CONVERT_AVX2 static std::size_t XRGB32_AVX2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line_src + 4 * j));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(line_dst + 4 * j), _mm256_or_si256(v, alpha));
+    }
+    return j;
+}
+CONVERT_AVX512BW static std::size_t XRGB32_AVX512BW(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m512i alpha = _mm512_set1_epi32(0xff000000);
+    std::size_t j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const __m512i v = _mm512_loadu_si512(line_src + 4 * j);
+        _mm512_storeu_si512(line_dst + 4 * j, _mm512_or_si512(v, alpha));
+    }
+    return j;
+}
+
+// R10G10B10A2 to RGBA8888: the 8 high bits of each channel are shifted in
+// place, the 2 alpha bits are repeated over the byte
+CONVERT_SSE2 static std::size_t RGB10A2_SSE2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m128i mask_r = _mm_set1_epi32(0x000000ff);
+    const __m128i mask_g = _mm_set1_epi32(0x0000ff00);
+    const __m128i mask_b = _mm_set1_epi32(0x00ff0000);
+    const __m128i mask_a = _mm_set1_epi32(0xc0000000);
+    std::size_t j = 0;
+    for (; j + 4 <= width; j += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line_src + 4 * j));
+        const __m128i r = _mm_and_si128(_mm_srli_epi32(v, 2), mask_r);
+        const __m128i g = _mm_and_si128(_mm_srli_epi32(v, 4), mask_g);
+        const __m128i b = _mm_and_si128(_mm_srli_epi32(v, 6), mask_b);
+        __m128i a = _mm_and_si128(v, mask_a);
+        a = _mm_or_si128(a, _mm_srli_epi32(a, 2));
+        a = _mm_or_si128(a, _mm_srli_epi32(a, 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(line_dst + 4 * j), _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, a)));
+    }
+    return j;
+}
+CONVERT_AVX2 static std::size_t RGB10A2_AVX2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m256i mask_r = _mm256_set1_epi32(0x000000ff);
+    const __m256i mask_g = _mm256_set1_epi32(0x0000ff00);
+    const __m256i mask_b = _mm256_set1_epi32(0x00ff0000);
+    const __m256i mask_a = _mm256_set1_epi32(0xc0000000);
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line_src + 4 * j));
+        const __m256i r = _mm256_and_si256(_mm256_srli_epi32(v, 2), mask_r);
+        const __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 4), mask_g);
+        const __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 6), mask_b);
+        __m256i a = _mm256_and_si256(v, mask_a);
+        a = _mm256_or_si256(a, _mm256_srli_epi32(a, 2));
+        a = _mm256_or_si256(a, _mm256_srli_epi32(a, 4));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(line_dst + 4 * j), _mm256_or_si256(_mm256_or_si256(r, g), _mm256_or_si256(b, a)));
+    }
+    return j;
+}
+CONVERT_AVX512BW static std::size_t RGB10A2_AVX512BW(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    const __m512i mask_r = _mm512_set1_epi32(0x000000ff);
+    const __m512i mask_g = _mm512_set1_epi32(0x0000ff00);
+    const __m512i mask_b = _mm512_set1_epi32(0x00ff0000);
+    const __m512i mask_a = _mm512_set1_epi32(0xc0000000);
+    // the zero masked forms compile to the same instructions, GCC 12 warns
+    // about an uninitialized operand in the unmasked ones
+    const __mmask16 all = 0xffff;
+    std::size_t j = 0;
+    for (; j + 16 <= width; j += 16) {
+        const __m512i v = _mm512_loadu_si512(line_src + 4 * j);
+        const __m512i r = _mm512_and_si512(_mm512_maskz_srli_epi32(all, v, 2), mask_r);
+        const __m512i g = _mm512_and_si512(_mm512_maskz_srli_epi32(all, v, 4), mask_g);
+        const __m512i b = _mm512_and_si512(_mm512_maskz_srli_epi32(all, v, 6), mask_b);
+        __m512i a = _mm512_and_si512(v, mask_a);
+        a = _mm512_or_si512(a, _mm512_maskz_srli_epi32(all, a, 2));
+        a = _mm512_or_si512(a, _mm512_maskz_srli_epi32(all, a, 4));
+        _mm512_storeu_si512(line_dst + 4 * j, _mm512_or_si512(_mm512_or_si512(r, g), _mm512_or_si512(b, a)));
+    }
+    return j;
+}
+#endif
+
+static inline void Convert_RGXX8888_RG88(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::size_t j = 0;
+#ifdef CPU_ISA_X86
+    j = ConvertSimd<RG88_SSE2, RG88_AVX2, RG88_AVX512BW>(line_dst, line_src, width);
+#endif
+    for (; j < width; ++j) {
+        line_dst[4 * j + 0] = line_src[2 * j + 0];
+        line_dst[4 * j + 1] = line_src[2 * j + 1];
+        line_dst[4 * j + 2] = 0x00;
+        line_dst[4 * j + 3] = 0xff;
+    }
+}
+static inline void Convert_XRGB4444(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::size_t j = 0;
+#ifdef CPU_ISA_X86
+    j = ConvertSimd<Mask16_SSE2<0x0fff>, Mask16_AVX2<0x0fff>, Mask16_AVX512BW<0x0fff>>(line_dst, line_src, width);
+#endif
+    for (; j < width; ++j) {
+        line_dst[2 * j + 0] = line_src[2 * j + 0];
+        line_dst[2 * j + 1] = line_src[2 * j + 1] & 0x0f; // set unused bits to 0
+    }
+}
+static inline void Convert_XRGB1555(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::size_t j = 0;
+#ifdef CPU_ISA_X86
+    j = ConvertSimd<Mask16_SSE2<0x7fff>, Mask16_AVX2<0x7fff>, Mask16_AVX512BW<0x7fff>>(line_dst, line_src, width);
+#endif
+    for (; j < width; ++j) {
+        line_dst[2 * j + 0] = line_src[2 * j + 0];
+        line_dst[2 * j + 1] = line_src[2 * j + 1] & 0x7f; // set unused bit to 0
+    }
+}
+static inline void Convert_XRGB32(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::size_t j = 0;
+#ifdef CPU_ISA_X86
+    j = ConvertSimd<XRGB32_SSE2, XRGB32_AVX2, XRGB32_AVX512BW>(line_dst, line_src, width);
+#endif
+    for (; j < width; ++j) {
+        line_dst[4 * j + 0] = line_src[4 * j + 0];
+        line_dst[4 * j + 1] = line_src[4 * j + 1];
+        line_dst[4 * j + 2] = line_src[4 * j + 2];
+        line_dst[4 * j + 3] = 0xff;
+    }
+}
+// R10G10B10A2 to RGBA8888, the 8 high bits of each channel and the 2 bits
+// alpha repeated
+static inline void Convert_RGBA8888_RGB10A2(uint8_t* line_dst, const uint8_t* line_src, std::size_t width)
+{
+    std::size_t j = 0;
+#ifdef CPU_ISA_X86
+    j = ConvertSimd<RGB10A2_SSE2, RGB10A2_AVX2, RGB10A2_AVX512BW>(line_dst, line_src, width);
+#endif
+    for (; j < width; ++j) {
+        uint32_t v;
+        std::memcpy(&v, line_src + 4 * j, sizeof(v));
+        line_dst[4 * j + 0] = v >> 2;
+        line_dst[4 * j + 1] = v >> 12;
+        line_dst[4 * j + 2] = v >> 22;
+        line_dst[4 * j + 3] = (v >> 30) * 0x55;
+    }
+}
@@ -0,0 +1,90 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Instruction set level of the SIMD kernels: block decoders, pixel converters
+// and tone mapping. Each level includes the ones below it. The best level of
+// the CPU is detected once, and the DDS_THUMBNAILER_ISA environment variable
+// can lower it ("generic", "sse2", "sse4.1", "avx2" or "avx512bw") to test or
+// time every variant on one machine.
+
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_ISA_X86 1
+#endif
+
+enum class Isa {
+    Generic,  ///< scalar code only
+    SSE2,
+    SSE41,
+    AVX2,     ///< with F16C
+    AVX512BW,
+};
+
+static constexpr const char* isa_names[] = {"generic", "sse2", "sse4.1", "avx2", "avx512bw"};
+
+inline const char* IsaName(Isa isa)
+{
+    return isa_names[static_cast<int>(isa)];
+}
+
+// Best level of this CPU
+inline Isa DetectIsa()
+{
+#ifdef CPU_ISA_X86
+    __builtin_cpu_init();
+    const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+    if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        return Isa::AVX512BW;
+    }
+    if (avx2) {
+        return Isa::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return Isa::SSE41;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return Isa::SSE2;
+    }
+#endif
+    return Isa::Generic;
+}
+
+// Level used by the kernels: DetectIsa(), or DDS_THUMBNAILER_ISA when it names
+// a lower level. Chosen on first use and kept for the process.
+inline Isa CpuIsa()
+{
+    static const Isa isa = [] {
+        const Isa detected = DetectIsa();
+        const char* name = std::getenv("DDS_THUMBNAILER_ISA");
+        for (int i = 0; name && i <= static_cast<int>(detected); ++i) {
+            if (std::strcmp(name, isa_names[i]) == 0) {
+                return static_cast<Isa>(i);
+            }
+        }
+        return detected;
+    }();
+    return isa;
+}
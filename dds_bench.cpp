@@ -0,0 +1,347 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// dds_bench: latency of DDSCreator::create() over a matrix of generated files
+// (every compressed and uncompressed format, several sizes, with and without
+// mip levels) or over the files given on the command line. Each file is
+// thumbnailed once to warm the caches, then timed over --runs runs. The
+// report gives the mean time of each stage of create(), the median and 99th
+// percentile of the total time and the texture megapixels decoded per second
+// at the median, as a table or as JSON to compare builds.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QJsonArray>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QTemporaryDir>
+#include <QtCore/QUrl>
+
+#include "dxgiformat.h"
+#include "DDS.h"
+
+#include "bench_stages.h"
+#include "cpu_isa.h"
+#include "thumbnailer_dds10.h"
+
+// Formats of the matrix, one per codec of bc_table and per entry of
+// uncompressed_table
+struct Format {
+    const char* name;
+    DirectX::DDS_PIXELFORMAT ddspf;
+    DXGI_FORMAT dxgi_format;  ///< DXGI_FORMAT_UNKNOWN if there is no DX10 header
+    std::size_t block_size;   ///< compressed block size, 0 if uncompressed
+    std::size_t bit_count;    ///< uncompressed pixel size
+};
+
+#define FOURCC_FORMAT(a, b, c, d) {sizeof(DirectX::DDS_PIXELFORMAT), DDS_FOURCC, MAKEFOURCC(a, b, c, d), 0, 0, 0, 0, 0}
+#define DX10_FORMAT FOURCC_FORMAT('D', 'X', '1', '0')
+
+static const Format formats[] = {
+    {"BC1",       FOURCC_FORMAT('D', 'X', 'T', '1'), DXGI_FORMAT_UNKNOWN,   8, 0},
+    {"BC2",       FOURCC_FORMAT('D', 'X', 'T', '3'), DXGI_FORMAT_UNKNOWN,  16, 0},
+    {"BC3",       FOURCC_FORMAT('D', 'X', 'T', '5'), DXGI_FORMAT_UNKNOWN,  16, 0},
+    {"BC4",       FOURCC_FORMAT('A', 'T', 'I', '1'), DXGI_FORMAT_UNKNOWN,   8, 0},
+    {"BC5",       FOURCC_FORMAT('A', 'T', 'I', '2'), DXGI_FORMAT_UNKNOWN,  16, 0},
+    {"BC6H_UF16", DX10_FORMAT, DXGI_FORMAT_BC6H_UF16,                      16, 0},
+    {"BC6H_SF16", DX10_FORMAT, DXGI_FORMAT_BC6H_SF16,                      16, 0},
+    {"BC7",       DX10_FORMAT, DXGI_FORMAT_BC7_UNORM,                      16, 0},
+    {"X4R4G4B4",  {32, DDS_RGB,       0, 16, 0x0f00, 0x00f0, 0x000f, 0}, DXGI_FORMAT_UNKNOWN, 0, 16},
+    {"X1R5G5B5",  {32, DDS_RGB,       0, 16, 0x7c00, 0x03e0, 0x001f, 0}, DXGI_FORMAT_UNKNOWN, 0, 16},
+    {"R5G6B5",    {32, DDS_RGB,       0, 16, 0xf800, 0x07e0, 0x001f, 0}, DXGI_FORMAT_UNKNOWN, 0, 16},
+    {"R8G8B8",    {32, DDS_RGB,       0, 24, 0xff0000, 0x00ff00, 0x0000ff, 0}, DXGI_FORMAT_UNKNOWN, 0, 24},
+    {"X8R8G8B8",  {32, DDS_RGB,       0, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0}, DXGI_FORMAT_UNKNOWN, 0, 32},
+    {"A8R8G8B8",  {32, DDS_RGBA,      0, 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}, DXGI_FORMAT_UNKNOWN, 0, 32},
+    {"L8",        {32, DDS_LUMINANCE, 0,  8, 0xff, 0, 0, 0}, DXGI_FORMAT_UNKNOWN, 0, 8},
+    {"L16",       {32, DDS_LUMINANCE, 0, 16, 0xffff, 0, 0, 0}, DXGI_FORMAT_UNKNOWN, 0, 16},
+    {"A8",        {32, DDS_ALPHA,     0,  8, 0, 0, 0, 0xff}, DXGI_FORMAT_UNKNOWN, 0, 8},
+    {"R8G8B8A8",  DX10_FORMAT, DXGI_FORMAT_R8G8B8A8_UNORM,                 0, 32},
+    {"R10G10B10A2", DX10_FORMAT, DXGI_FORMAT_R10G10B10A2_UNORM,            0, 32},
+    {"R8G8",      DX10_FORMAT, DXGI_FORMAT_R8G8_UNORM,                     0, 16},
+    {"R16G16B16A16", DX10_FORMAT, DXGI_FORMAT_R16G16B16A16_UNORM,          0, 64},
+    {"R16G16B16A16F", DX10_FORMAT, DXGI_FORMAT_R16G16B16A16_FLOAT,        0, 64},
+    {"R32G32B32A32F", DX10_FORMAT, DXGI_FORMAT_R32G32B32A32_FLOAT,        0, 128},
+    {"R32G32B32F", DX10_FORMAT, DXGI_FORMAT_R32G32B32_FLOAT,              0, 96},
+    {"R32G32F",   DX10_FORMAT, DXGI_FORMAT_R32G32_FLOAT,                   0, 64},
+    {"R16G16F",   DX10_FORMAT, DXGI_FORMAT_R16G16_FLOAT,                   0, 32},
+    {"R32F",      DX10_FORMAT, DXGI_FORMAT_R32_FLOAT,                      0, 32},
+    {"R16F",      DX10_FORMAT, DXGI_FORMAT_R16_FLOAT,                      0, 16},
+};
+
+static std::size_t LevelSize(const Format& format, std::size_t w, std::size_t h)
+{
+    if (format.block_size) {
+        return std::max<std::size_t>(1, (w + 3) / 4) * std::max<std::size_t>(1, (h + 3) / 4) * format.block_size;
+    }
+    return (w * format.bit_count + 7) / 8 * h;
+}
+
+// Write a size x size texture of random data, blocks of random bytes exercise
+// every mode of BC6H and BC7
+static bool GenerateFile(const QString& path, const Format& format, std::size_t size, bool mips)
+{
+    std::size_t mip_count = 1;
+    std::size_t data_size = LevelSize(format, size, size);
+    for (std::size_t s = size; mips && s > 1; s /= 2) {
+        ++mip_count;
+        data_size += LevelSize(format, s / 2, s / 2);
+    }
+    
+    DirectX::DDS_HEADER header = {};
+    header.size = sizeof(DirectX::DDS_HEADER);
+    header.flags = DDS_HEADER_FLAGS_TEXTURE | (mips ? DDS_HEADER_FLAGS_MIPMAP : 0);
+    header.height = size;
+    header.width = size;
+    header.mipMapCount = mip_count;
+    header.ddspf = format.ddspf;
+    header.caps = DDS_SURFACE_FLAGS_TEXTURE | (mips ? DDS_SURFACE_FLAGS_MIPMAP : 0);
+    DirectX::DDS_HEADER_DXT10 header10 = {format.dxgi_format, DirectX::DDS_DIMENSION_TEXTURE2D, 0, 1, 0};
+    
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+    const uint32_t magic = DirectX::DDS_MAGIC;
+    file.write(reinterpret_cast<const char*>(&magic), sizeof(magic));
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (format.dxgi_format != DXGI_FORMAT_UNKNOWN) {
+        file.write(reinterpret_cast<const char*>(&header10), sizeof(header10));
+    }
+    std::mt19937 random(size);
+    std::vector<uint32_t> chunk(1 << 20);
+    for (std::size_t written = 0; written < data_size; written += chunk.size() * sizeof(uint32_t)) {
+        std::generate(chunk.begin(), chunk.end(), std::ref(random));
+        const std::size_t length = std::min(data_size - written, chunk.size() * sizeof(uint32_t));
+        if (file.write(reinterpret_cast<const char*>(chunk.data()), length) != static_cast<qint64>(length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Result {
+    QString name;
+    std::size_t width = 0;
+    std::size_t height = 0;
+    bool mips = false;
+    qint64 file_size = 0;
+    bool ok = false;
+    double stages[BenchStageCount] = {}; ///< mean, in seconds
+    double mean = 0;
+    double p50 = 0;
+    double p99 = 0;
+};
+
+// Nearest rank percentile of sorted times
+static double Percentile(const std::vector<double>& sorted, double p)
+{
+    const std::size_t rank = static_cast<std::size_t>(p * sorted.size() + 0.999999);
+    return sorted[std::min(sorted.size(), std::max<std::size_t>(1, rank)) - 1];
+}
+
+static Result Run(DDSCreator& creator, const QString& path, std::size_t target, int runs)
+{
+    Result result;
+    result.file_size = QFileInfo(path).size();
+    const KIO::ThumbnailRequest request(QUrl::fromLocalFile(path), QSize(target, target), QStringLiteral("image/x-dds"), 1.0, 0.0f);
+    
+    const KIO::ThumbnailResult warm_up = creator.create(request);
+    if (!warm_up.isValid()) {
+        return result;
+    }
+    result.ok = true;
+    
+    std::vector<double> times;
+    for (int i = 0; i < runs; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        const KIO::ThumbnailResult thumbnail = creator.create(request);
+        times.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        result.ok = result.ok && thumbnail.isValid();
+        for (int s = 0; s < BenchStageCount; ++s) {
+            result.stages[s] += bench_stage_times.seconds[s] / runs;
+        }
+        result.mean += times.back() / runs;
+    }
+    std::sort(times.begin(), times.end());
+    result.p50 = Percentile(times, 0.50);
+    result.p99 = Percentile(times, 0.99);
+    return result;
+}
+
+static double MegapixelsPerSecond(const Result& result)
+{
+    return result.p50 > 0 ? result.width * result.height / 1e6 / result.p50 : 0.0;
+}
+
+static void PrintResult(const Result& result)
+{
+    if (!result.ok) {
+        std::printf("%-12s %5zux%-5zu %-4s failed\n", qPrintable(result.name), result.width, result.height, result.mips ? "mips" : "");
+        return;
+    }
+    std::printf("%-12s %5zux%-5zu %-4s", qPrintable(result.name), result.width, result.height, result.mips ? "mips" : "");
+    for (int s = 0; s < BenchStageCount; ++s) {
+        std::printf(" %s %9.3f", BenchStageName(s), result.stages[s] * 1e3);
+    }
+    std::printf(" | p50 %9.3f p99 %9.3f ms | %9.1f MP/s\n", result.p50 * 1e3, result.p99 * 1e3, MegapixelsPerSecond(result));
+    std::fflush(stdout);
+}
+
+static QJsonObject ResultJson(const Result& result)
+{
+    QJsonObject stages;
+    for (int s = 0; s < BenchStageCount; ++s) {
+        stages[QLatin1String(BenchStageName(s))] = result.stages[s] * 1e3;
+    }
+    QJsonObject object;
+    object[QStringLiteral("name")] = result.name;
+    object[QStringLiteral("width")] = static_cast<qint64>(result.width);
+    object[QStringLiteral("height")] = static_cast<qint64>(result.height);
+    object[QStringLiteral("mips")] = result.mips;
+    object[QStringLiteral("file_size")] = result.file_size;
+    object[QStringLiteral("ok")] = result.ok;
+    object[QStringLiteral("stages_ms")] = stages;
+    object[QStringLiteral("mean_ms")] = result.mean * 1e3;
+    object[QStringLiteral("p50_ms")] = result.p50 * 1e3;
+    object[QStringLiteral("p99_ms")] = result.p99 * 1e3;
+    object[QStringLiteral("mpixels_per_s")] = MegapixelsPerSecond(result);
+    return object;
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Time DDSCreator::create() over generated or given DDS files."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("files"), QStringLiteral("DDS files to time instead of the generated matrix."), QStringLiteral("[files...]"));
+    const QCommandLineOption runs_option(QStringLiteral("runs"), QStringLiteral("Timed runs per file (default 10)."), QStringLiteral("n"), QStringLiteral("10"));
+    const QCommandLineOption target_option(QStringLiteral("target"), QStringLiteral("Thumbnail size (default 256)."), QStringLiteral("pixels"), QStringLiteral("256"));
+    const QCommandLineOption sizes_option(QStringLiteral("sizes"), QStringLiteral("Comma separated texture sizes (default 64,256,1024,4096,16384)."),
+                                          QStringLiteral("list"), QStringLiteral("64,256,1024,4096,16384"));
+    const QCommandLineOption formats_option(QStringLiteral("formats"), QStringLiteral("Comma separated formats of the matrix (default all)."), QStringLiteral("list"));
+    const QCommandLineOption json_option(QStringLiteral("json"), QStringLiteral("Write the results as JSON to file, - for stdout."), QStringLiteral("file"));
+    const QCommandLineOption dir_option(QStringLiteral("dir"), QStringLiteral("Directory of the generated files (default a temporary directory)."), QStringLiteral("dir"));
+    const QCommandLineOption isa_option(QStringLiteral("isa"), QStringLiteral("Instruction set level of the kernels: generic, sse2, sse4.1, avx2 or avx512bw (default the best of the CPU)."),
+                                        QStringLiteral("level"));
+    parser.addOptions({runs_option, target_option, sizes_option, formats_option, json_option, dir_option, isa_option});
+    parser.process(app);
+    // read by CpuIsa() on first use, which is in the DDSCreator constructor
+    if (parser.isSet(isa_option)) {
+        qputenv("DDS_THUMBNAILER_ISA", parser.value(isa_option).toLatin1());
+    }
+    // the whole decode is timed, not the fallback of the time budget
+    if (!qEnvironmentVariableIsSet("DDS_THUMBNAILER_TIMEOUT")) {
+        qputenv("DDS_THUMBNAILER_TIMEOUT", "0");
+    }
+    
+    const int runs = std::max(1, parser.value(runs_option).toInt());
+    const std::size_t target = std::max(1, parser.value(target_option).toInt());
+    const bool json_stdout = parser.value(json_option) == QLatin1String("-");
+    
+    DDSCreator creator(nullptr, {});
+    if (!json_stdout) {
+        std::printf("instruction set: %s\n", IsaName(CpuIsa()));
+    }
+    std::vector<Result> results;
+    auto add = [&](Result result) {
+        if (!json_stdout) {
+            PrintResult(result);
+        }
+        results.push_back(result);
+    };
+    
+    if (!parser.positionalArguments().isEmpty()) {
+        for (const QString& path : parser.positionalArguments()) {
+            Result result = Run(creator, path, target, runs);
+            result.name = path;
+            // texture size for MP/s, create() has already checked the header
+            QFile file(path);
+            DirectX::DDS_HEADER header = {};
+            if (file.open(QIODevice::ReadOnly) && file.seek(4)) {
+                file.read(reinterpret_cast<char*>(&header), sizeof(header));
+            }
+            result.width = header.width;
+            result.height = header.height;
+            add(result);
+        }
+    } else {
+        QTemporaryDir temporary_dir;
+        const QString dir = parser.isSet(dir_option) ? parser.value(dir_option) : temporary_dir.path();
+        const QStringList names = parser.value(formats_option).split(QLatin1Char(','), Qt::SkipEmptyParts);
+        for (const Format& format : formats) {
+            if (!names.isEmpty() && !names.contains(QLatin1String(format.name), Qt::CaseInsensitive)) {
+                continue;
+            }
+            for (const QString& size_arg : parser.value(sizes_option).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+                const std::size_t size = size_arg.toUInt();
+                for (bool mips : {false, true}) {
+                    // one file at a time, the largest ones take GiBs of disk
+                    const QString path = dir + QLatin1Char('/') + QLatin1String(format.name) + QLatin1Char('_') + QString::number(size)
+                                         + QLatin1String(mips ? "_mips.dds" : ".dds");
+                    Result result;
+                    if (size > 0 && GenerateFile(path, format, size, mips)) {
+                        result = Run(creator, path, target, runs);
+                    }
+                    QFile::remove(path);
+                    result.name = QLatin1String(format.name);
+                    result.width = size;
+                    result.height = size;
+                    result.mips = mips;
+                    add(result);
+                }
+            }
+        }
+    }
+    
+    if (parser.isSet(json_option)) {
+        QJsonArray array;
+        for (const Result& result : results) {
+            array.append(ResultJson(result));
+        }
+        QJsonObject root;
+        root[QStringLiteral("runs")] = runs;
+        root[QStringLiteral("target")] = static_cast<qint64>(target);
+        root[QStringLiteral("isa")] = QLatin1String(IsaName(CpuIsa()));
+        root[QStringLiteral("results")] = array;
+        const QByteArray json = QJsonDocument(root).toJson();
+        if (json_stdout) {
+            std::fwrite(json.constData(), 1, json.size(), stdout);
+        } else {
+            QFile file(parser.value(json_option));
+            if (!file.open(QIODevice::WriteOnly) || file.write(json) != json.size()) {
+                std::fprintf(stderr, "could not write %s\n", qPrintable(parser.value(json_option)));
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
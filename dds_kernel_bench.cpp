@@ -0,0 +1,494 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// dds_kernel_bench: throughput of the hot kernels one at a time, the bcdec
+// block decoders, the SIMD multi-block decoders, the PFN_Convert row
+// converters and the HDR tone mapping. Each kernel runs over a stream of
+// random blocks or of the data of a real DDS file (--file), either hot in
+// cache (a small buffer processed again and again) or cold in DRAM (a buffer
+// much larger than the last level cache processed once per pass). Blocks are
+// decoded by rows into a strip that stays in cache, like DecodeTile() does.
+//
+// The report gives ns per block (decoders) or per pixel (converters) and
+// input bytes per cycle. Cycles come from the cycles counter with --perf and
+// from the time stamp counter otherwise. --perf also reports branch misses,
+// L1D read misses and LLC read misses per block or pixel, through
+// perf_event_open(); counters the kernel refuses are shown as "-".
+//
+// The converters run the SIMD loops of CpuIsa(), set DDS_THUMBNAILER_ISA to
+// time a lower level; it also skips the decoders above that level.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BCDEC_STATIC
+#define BCDEC_IMPLEMENTATION
+#include "bcdec.h"
+
+#include "dxgiformat.h"
+#include "DDS.h"
+
+#include "bc_simd.h"
+#include "bc7_simd.h"
+#include "convert.h"
+#include "tonemap.h"
+
+#ifdef BC_SIMD_X86
+#include <x86intrin.h>
+#endif
+
+// Kernels /////////////////////////////////////////////////////////////////////
+// A kernel processes count blocks or pixels of a row from src into dst
+typedef void (*PFN_Run)(const uint8_t* src, uint8_t* dst, std::size_t count);
+
+struct Kernel {
+    const char* name;
+    std::size_t input_size;  ///< bytes of a block or of a source pixel
+    std::size_t output_size; ///< bytes of a decoded block or of a converted pixel
+    bool block;              ///< count is in 4x4 blocks, otherwise in pixels
+    PFN_Run Run;
+    const char* cpu_feature; ///< needed by the kernel, nullptr for none
+};
+
+typedef void (*PFN_DecodeBlock)(const void* compressedBlock, void* decompressedBlock, int destinationPitch);
+typedef std::size_t (*PFN_DecodeBlocks)(const unsigned char* src, unsigned char* dst, std::size_t pitch, std::size_t count);
+
+// One bcdec call per block into a 4 rows strip
+template <PFN_DecodeBlock Decode, std::size_t block_size, std::size_t pixel_size>
+static void RunDecode(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    const int pitch = count * 4 * pixel_size;
+    for (std::size_t i = 0; i < count; ++i) {
+        Decode(src + i * block_size, dst + i * 4 * pixel_size, pitch);
+    }
+}
+
+static void DecodeBC6HHalf(const void* compressedBlock, void* decompressedBlock, int destinationPitch)
+{
+    bcdec_bc6h_half(compressedBlock, decompressedBlock, destinationPitch / sizeof(uint16_t), 0);
+}
+static void DecodeBC6HFloat(const void* compressedBlock, void* decompressedBlock, int destinationPitch)
+{
+    bcdec_bc6h_float(compressedBlock, decompressedBlock, destinationPitch / sizeof(float), 0);
+}
+
+#ifdef BC_SIMD_X86
+// SIMD decoder for the largest multiple of its batch, bcdec for the rest
+template <PFN_DecodeBlocks DecodeBlocks, PFN_DecodeBlock Decode, std::size_t block_size>
+static void RunDecodeBlocks(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    const std::size_t pitch = count * 4 * 4;
+    const std::size_t decoded = DecodeBlocks(src, dst, pitch, count);
+    for (std::size_t i = decoded; i < count; ++i) {
+        Decode(src + i * block_size, dst + i * 4 * 4, pitch);
+    }
+}
+#endif
+
+template <PFN_Convert Convert>
+static void RunConvert(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    Convert(dst, src, count);
+}
+
+static const ToneMap bench_tone_map;
+
+static void RunToneMap_C(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    ToneMapRGBHalf_C(bench_tone_map, dst, reinterpret_cast<const uint16_t*>(src), count);
+}
+#ifdef TONEMAP_F16C
+static void RunToneMap_F16C(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    ToneMapRGBHalf_F16C(bench_tone_map, dst, reinterpret_cast<const uint16_t*>(src), count);
+}
+#endif
+
+// RGBA16F through the RGBA float buffer of ToneMapFloat()
+template <void (*Load)(FloatLayout, float*, const uint8_t*, std::size_t), void (*Map)(const ToneMap&, uint8_t*, const float*, std::size_t)>
+static void RunToneMapFloat(const uint8_t* src, uint8_t* dst, std::size_t count)
+{
+    constexpr std::size_t chunk = 256;
+    alignas(32) float rgba[chunk * 4];
+    for (std::size_t j = 0; j < count; j += chunk) {
+        const std::size_t n = std::min(chunk, count - j);
+        Load({4, true}, rgba, src + j * 8, n);
+        Map(bench_tone_map, dst + j * 4, rgba, n);
+    }
+}
+
+static const Kernel kernels[] = {
+    {"bcdec_bc1",        8, 64, true, RunDecode<bcdec_bc1, 8, 4>, nullptr},
+    {"bcdec_bc2",       16, 64, true, RunDecode<bcdec_bc2, 16, 4>, nullptr},
+    {"bcdec_bc3",       16, 64, true, RunDecode<bcdec_bc3, 16, 4>, nullptr},
+    {"bcdec_bc4",        8, 16, true, RunDecode<bcdec_bc4, 8, 1>, nullptr},
+    {"bcdec_bc5",       16, 32, true, RunDecode<bcdec_bc5, 16, 2>, nullptr},
+    {"bcdec_bc6h_half", 16, 96, true, RunDecode<DecodeBC6HHalf, 16, 3 * sizeof(uint16_t)>, nullptr},
+    {"bcdec_bc6h_float", 16, 192, true, RunDecode<DecodeBC6HFloat, 16, 3 * sizeof(float)>, nullptr},
+    {"bcdec_bc7",       16, 64, true, RunDecode<bcdec_bc7, 16, 4>, nullptr},
+#ifdef BC_SIMD_X86
+    {"simd_bc1_sse41",   8, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC1_SSE41, bcdec_bc1, 8>, "sse4.1"},
+    {"simd_bc1_avx2",    8, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC1_AVX2, bcdec_bc1, 8>, "avx2"},
+    {"simd_bc2_sse41",  16, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC2_SSE41, bcdec_bc2, 16>, "sse4.1"},
+    {"simd_bc2_avx2",   16, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC2_AVX2, bcdec_bc2, 16>, "avx2"},
+    {"simd_bc3_sse41",  16, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC3_SSE41, bcdec_bc3, 16>, "sse4.1"},
+    {"simd_bc3_avx2",   16, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC3_AVX2, bcdec_bc3, 16>, "avx2"},
+    {"simd_bc7_sse41",  16, 64, true, RunDecodeBlocks<bc_simd::DecodeBlocksBC7_SSE41, bcdec_bc7, 16>, "sse4.1"},
+#endif
+    {"Convert_NOOP8",          1, 1, false, RunConvert<Convert_NOOP8>, nullptr},
+    {"Convert_NOOP16",         2, 2, false, RunConvert<Convert_NOOP16>, nullptr},
+    {"Convert_NOOP24",         3, 3, false, RunConvert<Convert_NOOP24>, nullptr},
+    {"Convert_NOOP32",         4, 4, false, RunConvert<Convert_NOOP32>, nullptr},
+    {"Convert_NOOP64",         8, 8, false, RunConvert<Convert_NOOP64>, nullptr},
+    {"Convert_RGXX8888_RG88",  2, 4, false, RunConvert<Convert_RGXX8888_RG88>, nullptr},
+    {"Convert_XRGB4444",       2, 2, false, RunConvert<Convert_XRGB4444>, nullptr},
+    {"Convert_XRGB1555",       2, 2, false, RunConvert<Convert_XRGB1555>, nullptr},
+    {"Convert_XRGB32",         4, 4, false, RunConvert<Convert_XRGB32>, nullptr},
+    {"Convert_RGBA8888_RGB10A2", 4, 4, false, RunConvert<Convert_RGBA8888_RGB10A2>, nullptr},
+    {"ToneMapRGBHalf_C",       6, 4, false, RunToneMap_C, nullptr},
+#ifdef TONEMAP_F16C
+    {"ToneMapRGBHalf_F16C",    6, 4, false, RunToneMap_F16C, "f16c"},
+#endif
+    {"ToneMapFloat_RGBA16F_C", 8, 4, false, RunToneMapFloat<LoadRGBAFloat_C, ToneMapRGBAFloat_C>, nullptr},
+#ifdef TONEMAP_F16C
+    {"ToneMapFloat_RGBA16F_AVX2", 8, 4, false, RunToneMapFloat<LoadRGBAFloat_F16C, ToneMapRGBAFloat_AVX2>, "avx2"},
+#endif
+};
+
+// Instruction set levels are compared to CpuIsa(), so DDS_THUMBNAILER_ISA also
+// limits the kernels run here
+static bool Supported(const Kernel& kernel)
+{
+#ifdef BC_SIMD_X86
+    if (kernel.cpu_feature) {
+        const std::string feature = kernel.cpu_feature;
+        if (feature == "f16c") {return CpuIsa() >= Isa::SSE41 && __builtin_cpu_supports("f16c");}
+        for (int i = 0; i <= static_cast<int>(CpuIsa()); ++i) {
+            if (feature == isa_names[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
+    return kernel.cpu_feature == nullptr;
+}
+
+// Performance counters ////////////////////////////////////////////////////////
+// Group of hardware counters of the calling thread, read together. The cycles
+// counter leads the group; the others are optional.
+class PerfCounters
+{
+    public:
+        enum Counter {Cycles, BranchMisses, L1DMisses, LLCMisses, CounterCount};
+
+        PerfCounters();
+        ~PerfCounters();
+
+        bool valid() const {return fd[Cycles] >= 0;}
+        bool has(Counter counter) const {return fd[counter] >= 0;}
+        void start();
+        void stop(uint64_t value[CounterCount]);
+
+    private:
+        int fd[CounterCount];
+};
+
+PerfCounters::PerfCounters()
+{
+    static const struct {uint32_t type; uint64_t config;} events[CounterCount] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+    for (int i = 0; i < CounterCount; ++i) {
+        fd[i] = -1;
+        if (i > 0 && fd[Cycles] < 0) {
+            continue;
+        }
+        perf_event_attr attr = {};
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.disabled = i == Cycles;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+        fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, i == Cycles ? -1 : fd[Cycles], 0);
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int i = CounterCount - 1; i >= 0; --i) {
+        if (fd[i] >= 0) {
+            close(fd[i]);
+        }
+    }
+}
+
+void PerfCounters::start()
+{
+    ioctl(fd[Cycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fd[Cycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void PerfCounters::stop(uint64_t value[CounterCount])
+{
+    ioctl(fd[Cycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    // PERF_FORMAT_GROUP | PERF_FORMAT_ID: count, then {value, id} per event
+    uint64_t data[1 + 2 * CounterCount] = {};
+    std::fill(value, value + CounterCount, 0);
+    if (read(fd[Cycles], data, sizeof(data)) <= 0) {
+        return;
+    }
+    uint64_t id[CounterCount] = {};
+    for (int i = 0; i < CounterCount; ++i) {
+        if (fd[i] >= 0) {
+            ioctl(fd[i], PERF_EVENT_IOC_ID, &id[i]);
+        }
+    }
+    for (uint64_t e = 0; e < data[0] && e < CounterCount; ++e) {
+        for (int i = 0; i < CounterCount; ++i) {
+            if (fd[i] >= 0 && id[i] == data[2 + 2 * e]) {
+                value[i] = data[1 + 2 * e];
+            }
+        }
+    }
+}
+
+static uint64_t TimeStampCounter()
+{
+#ifdef BC_SIMD_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Measurement /////////////////////////////////////////////////////////////////
+// Blocks or pixels per row: a row of blocks decodes into a strip of a few
+// dozen KiB like the tiles of DecodeTile()
+static constexpr std::size_t row_blocks = 256;
+static constexpr std::size_t row_pixels = 1024;
+static constexpr std::size_t hot_size = 32 << 10;
+
+struct Options {
+    std::vector<std::string> kernels; ///< all kernels if empty
+    std::string file;                 ///< DDS file of the real-world stream
+    std::size_t cold_size = 512 << 20;
+    double min_time = 0.2;            ///< seconds per measurement
+    bool perf = false;
+};
+
+struct Measure {
+    double seconds = 0;
+    uint64_t items = 0;
+    uint64_t bytes = 0;
+    uint64_t tsc = 0;
+    uint64_t counters[PerfCounters::CounterCount] = {};
+};
+
+// Process the whole input, row by row, until min_time has elapsed; the cold
+// buffer is processed once per pass so that every pass reads it from DRAM
+static Measure Run(const Kernel& kernel, const std::vector<uint8_t>& input, std::vector<uint8_t>& output, double min_time, PerfCounters* perf)
+{
+    const std::size_t row_items = kernel.block ? row_blocks : row_pixels;
+    const std::size_t row_bytes = row_items * kernel.input_size;
+    const std::size_t rows = input.size() / row_bytes;
+    
+    kernel.Run(input.data(), output.data(), row_items); // warm up code and tables
+    Measure measure;
+    if (perf) {
+        perf->start();
+    }
+    const uint64_t tsc = TimeStampCounter();
+    const auto start = std::chrono::steady_clock::now();
+    do {
+        for (std::size_t r = 0; r < rows; ++r) {
+            kernel.Run(input.data() + r * row_bytes, output.data(), row_items);
+        }
+        measure.items += rows * row_items;
+        measure.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    } while (measure.seconds < min_time);
+    measure.tsc = TimeStampCounter() - tsc;
+    if (perf) {
+        perf->stop(measure.counters);
+    }
+    measure.bytes = measure.items * kernel.input_size;
+    return measure;
+}
+
+// Stream of size bytes, random or repeating the data of the DDS file
+static std::vector<uint8_t> MakeStream(std::size_t size, const std::vector<uint8_t>& file_data)
+{
+    std::vector<uint8_t> stream(size);
+    if (file_data.empty()) {
+        std::mt19937 random(42);
+        for (std::size_t i = 0; i + 4 <= size; i += 4) {
+            const uint32_t value = random();
+            std::memcpy(&stream[i], &value, 4);
+        }
+    } else {
+        for (std::size_t i = 0; i < size; i += file_data.size()) {
+            std::memcpy(&stream[i], file_data.data(), std::min(file_data.size(), size - i));
+        }
+    }
+    return stream;
+}
+
+// Image data of a DDS file, after the headers
+static bool ReadFileData(const std::string& path, std::vector<uint8_t>& data)
+{
+    std::ifstream file(path, std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    std::size_t offset = 4 + sizeof(DirectX::DDS_HEADER);
+    if (data.size() < offset) {
+        return false;
+    }
+    const DirectX::DDS_HEADER& header = *reinterpret_cast<const DirectX::DDS_HEADER*>(data.data() + 4);
+    if (header.ddspf.flags & DDS_FOURCC && header.ddspf.fourCC == MAKEFOURCC('D', 'X', '1', '0')) {
+        offset += sizeof(DirectX::DDS_HEADER_DXT10);
+    }
+    if (data.size() <= offset) {
+        return false;
+    }
+    data.erase(data.begin(), data.begin() + offset);
+    return true;
+}
+
+static void PrintMeasure(const Kernel& kernel, const char* stream, const Measure& m, const PerfCounters* perf)
+{
+    const double items = m.items;
+    const uint64_t cycles = perf && perf->has(PerfCounters::Cycles) ? m.counters[PerfCounters::Cycles] : m.tsc;
+    std::printf("%-22s %-11s %9.3f ns/%-5s", kernel.name, stream, m.seconds * 1e9 / items, kernel.block ? "block" : "px");
+    if (cycles) {
+        std::printf(" %7.3f B/cycle", m.bytes / double(cycles));
+    } else {
+        std::printf(" %7s B/cycle", "-");
+    }
+    if (perf) {
+        static const char* const names[PerfCounters::CounterCount] = {"cycles", "br-miss", "L1D-miss", "LLC-miss"};
+        for (int c = 0; c < PerfCounters::CounterCount; ++c) {
+            if (perf->has(static_cast<PerfCounters::Counter>(c))) {
+                std::printf(" %s %8.3f", names[c], m.counters[c] / items);
+            } else {
+                std::printf(" %s %8s", names[c], "-");
+            }
+        }
+    }
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+static void Usage(const char* program)
+{
+    std::fprintf(stderr,
+        "Usage: %s [--kernels name,...] [--file texture.dds] [--cold-size MiB] [--min-time seconds] [--perf] [--list]\n"
+        "Time the block decoders and pixel converters on random data or on the data of a DDS file,\n"
+        "hot in cache and cold in DRAM.\n", program);
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool has_value = i + 1 < argc;
+        if (arg == "--kernels" && has_value) {
+            std::string list = argv[++i];
+            for (std::size_t begin = 0, end; begin <= list.size(); begin = end + 1) {
+                end = std::min(list.find(',', begin), list.size());
+                if (end > begin) {
+                    options.kernels.push_back(list.substr(begin, end - begin));
+                }
+            }
+        } else if (arg == "--file" && has_value) {
+            options.file = argv[++i];
+        } else if (arg == "--cold-size" && has_value) {
+            options.cold_size = std::max(1l, std::atol(argv[++i])) << 20;
+        } else if (arg == "--min-time" && has_value) {
+            options.min_time = std::atof(argv[++i]);
+        } else if (arg == "--perf") {
+            options.perf = true;
+        } else if (arg == "--list") {
+            for (const Kernel& kernel : kernels) {
+                std::printf("%s%s\n", kernel.name, Supported(kernel) ? "" : " (not supported by this CPU)");
+            }
+            return 0;
+        } else {
+            Usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    
+    std::vector<uint8_t> file_data;
+    if (!options.file.empty() && !ReadFileData(options.file, file_data)) {
+        std::fprintf(stderr, "could not read %s\n", options.file.c_str());
+        return 1;
+    }
+    const char* const stream_name = file_data.empty() ? "random" : "file";
+    
+    std::unique_ptr<PerfCounters> perf;
+    if (options.perf) {
+        perf.reset(new PerfCounters);
+        if (!perf->valid()) {
+            std::fprintf(stderr, "perf_event_open() failed, check /proc/sys/kernel/perf_event_paranoid\n");
+            perf.reset();
+        }
+    }
+    
+    // streams are shared by the kernels, rounded per kernel to whole rows
+    const std::vector<uint8_t> hot = MakeStream(hot_size, file_data);
+    const std::vector<uint8_t> cold = MakeStream(options.cold_size, file_data);
+    std::vector<uint8_t> output(row_blocks * 4 * 4 * 3 * sizeof(float)); // largest strip, BC6H as floats
+    
+    std::printf("instruction set: %s\n", IsaName(CpuIsa()));
+    for (const Kernel& kernel : kernels) {
+        if (!options.kernels.empty() && std::find(options.kernels.begin(), options.kernels.end(), kernel.name) == options.kernels.end()) {
+            continue;
+        }
+        if (!Supported(kernel)) {
+            std::printf("%-22s not supported by this CPU\n", kernel.name);
+            continue;
+        }
+        const std::string hot_name = std::string(stream_name) + "/hot";
+        const std::string cold_name = std::string(stream_name) + "/cold";
+        PrintMeasure(kernel, hot_name.c_str(), Run(kernel, hot, output, options.min_time, perf.get()), perf.get());
+        PrintMeasure(kernel, cold_name.c_str(), Run(kernel, cold, output, options.min_time, perf.get()), perf.get());
+    }
+    return 0;
+}
@@ -0,0 +1,301 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// dds-thumb: thumbnails of every DDS file of directory trees, for machines
+// without a desktop session. A thread walks the trees and feeds --jobs
+// workers, each one decoding a whole file at a time, so that the decoding of
+// some files overlaps with the disk reads of others. A worker holds a single
+// file and decodes it within the --memory budget, falling back to smaller
+// levels or sampled texels, so memory stays under jobs times the budget plus
+// the --pool MiB of decoded images kept between files. Thumbnails are written
+// as PNG or as raw RGBA8888 to --output, mirroring the input trees, one per
+// --sizes. The report gives the files per second and lists the failures.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtGui/QImage>
+
+#include "buffer_pool.h"
+#include "libdds.h"
+#include "libdds_qt.h"
+
+// A file to thumbnail
+struct Entry {
+    QString path;
+    QString output; ///< output path, without size and extension
+};
+
+// Files waiting for a worker, bounded so that walking a large tree does not
+// run far ahead of decoding
+class FileQueue
+{
+    public:
+        explicit FileQueue(std::size_t capacity) : capacity(capacity) {}
+
+        // Wait while the queue is full
+        void push(Entry entry)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_full.wait(lock, [this] {return entries.size() < capacity;});
+            entries.push_back(std::move(entry));
+            not_empty.notify_one();
+        }
+
+        // Wait for an entry, false once the queue is closed and empty
+        bool pop(Entry& entry)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] {return !entries.empty() || closed;});
+            if (entries.empty()) {
+                return false;
+            }
+            entry = std::move(entries.front());
+            entries.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        // No more entries
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            not_empty.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::condition_variable not_full;
+        std::deque<Entry> entries;
+        const std::size_t capacity;
+        bool closed = false;
+};
+
+struct Settings {
+    std::vector<int> sizes; ///< ascending
+    bool raw = false;       ///< raw RGBA8888 instead of PNG
+    dds::Options options;
+    BufferPool* buffers = nullptr; ///< of the decoded images
+};
+
+struct Stats {
+    std::atomic<std::size_t> files{0};
+    std::atomic<std::size_t> thumbnails{0};
+    std::mutex mutex;
+    std::vector<QString> failures;
+};
+
+// Thumbnails of one file, an error message on failure
+static QString Thumbnail(const Entry& entry, const Settings& settings, Stats& stats)
+{
+    // decoded once for the largest size, smaller sizes are scaled from it
+    const int largest = settings.sizes.back();
+    QString error;
+    const QImage img = DecodeThumbnail(entry.path, largest, largest, settings.options, error, settings.buffers);
+    if (img.isNull()) {
+        return error;
+    }
+    
+    if (!QDir().mkpath(QFileInfo(entry.output).path())) {
+        return QStringLiteral("could not create output directory");
+    }
+    for (int size : settings.sizes) {
+        QImage thumbnail = img.width() > size || img.height() > size ? img.scaled(size, size, Qt::KeepAspectRatio, Qt::SmoothTransformation) : img;
+        const QString name = entry.output + QLatin1Char('.') + QString::number(size);
+        if (settings.raw) {
+            thumbnail = thumbnail.convertToFormat(QImage::Format_RGBA8888);
+            QFile out(name + QLatin1Char('.') + QString::number(thumbnail.width()) + QLatin1Char('x')
+                      + QString::number(thumbnail.height()) + QLatin1String(".rgba"));
+            if (!out.open(QIODevice::WriteOnly)) {
+                return QStringLiteral("could not write thumbnail");
+            }
+            const qint64 row_size = thumbnail.width() * 4;
+            for (int y = 0; y < thumbnail.height(); ++y) {
+                if (out.write(reinterpret_cast<const char*>(thumbnail.constScanLine(y)), row_size) != row_size) {
+                    return QStringLiteral("could not write thumbnail");
+                }
+            }
+        } else if (!thumbnail.save(name + QLatin1String(".png"), "PNG")) {
+            return QStringLiteral("could not write thumbnail");
+        }
+        ++stats.thumbnails;
+    }
+    return QString();
+}
+
+// Queue the DDS files of the inputs, directories are walked recursively
+static void Walk(const QStringList& inputs, const QString& output_dir, FileQueue& queue)
+{
+    for (const QString& input : inputs) {
+        const QFileInfo info(input);
+        if (!info.isDir()) {
+            queue.push({input, output_dir + QLatin1Char('/') + info.fileName()});
+            continue;
+        }
+        const QDir root(input);
+        QDirIterator it(input, {QStringLiteral("*.dds")}, QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            const QString path = it.next();
+            queue.push({path, output_dir + QLatin1Char('/') + root.relativeFilePath(path)});
+        }
+    }
+    queue.close();
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Write thumbnails of DDS files and directory trees of DDS files."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("inputs"), QStringLiteral("DDS files or directories, walked recursively."), QStringLiteral("inputs..."));
+    const QCommandLineOption output_option({QStringLiteral("o"), QStringLiteral("output")}, QStringLiteral("Output directory."), QStringLiteral("dir"));
+    const QCommandLineOption sizes_option(QStringLiteral("sizes"), QStringLiteral("Comma separated thumbnail sizes (default 256)."), QStringLiteral("list"), QStringLiteral("256"));
+    const QCommandLineOption format_option(QStringLiteral("format"), QStringLiteral("png (default) or rgba, raw RGBA8888 named <file>.<size>.<width>x<height>.rgba."),
+                                           QStringLiteral("format"), QStringLiteral("png"));
+    const QCommandLineOption jobs_option(QStringLiteral("jobs"), QStringLiteral("Files decoded at once (default twice the number of cores)."), QStringLiteral("n"));
+    const QCommandLineOption sampling_option(QStringLiteral("sampling"), QStringLiteral("Sampling of huge textures: average (default), texel or off."),
+                                             QStringLiteral("mode"), QStringLiteral("average"));
+    const QCommandLineOption tonemap_option(QStringLiteral("tonemap"), QStringLiteral("Tone curve of HDR textures: aces (default) or reinhard."),
+                                            QStringLiteral("curve"), QStringLiteral("aces"));
+    const QCommandLineOption memory_option(QStringLiteral("memory"), QStringLiteral("Memory budget of a file in MiB (default 256, 0 for none)."),
+                                           QStringLiteral("mib"), QString::number(dds::default_memory_budget >> 20));
+    const QCommandLineOption pool_option(QStringLiteral("pool"), QStringLiteral("MiB of decoded images kept for the next files (default 128, 0 for none)."),
+                                         QStringLiteral("mib"), QStringLiteral("128"));
+    parser.addOptions({output_option, sizes_option, format_option, jobs_option, sampling_option, tonemap_option, memory_option, pool_option});
+    parser.process(app);
+    
+    const QStringList inputs = parser.positionalArguments();
+    if (inputs.isEmpty() || !parser.isSet(output_option)) {
+        parser.showHelp(1);
+    }
+    
+    Settings settings;
+    for (const QString& size : parser.value(sizes_option).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+        const int value = size.toInt();
+        if (value <= 0) {
+            std::fprintf(stderr, "invalid size %s\n", qPrintable(size));
+            return 1;
+        }
+        settings.sizes.push_back(value);
+    }
+    if (settings.sizes.empty()) {
+        std::fprintf(stderr, "no size\n");
+        return 1;
+    }
+    std::sort(settings.sizes.begin(), settings.sizes.end());
+    settings.sizes.erase(std::unique(settings.sizes.begin(), settings.sizes.end()), settings.sizes.end());
+    
+    const QString format = parser.value(format_option).toLower();
+    if (format != QLatin1String("png") && format != QLatin1String("rgba")) {
+        std::fprintf(stderr, "unknown format %s\n", qPrintable(format));
+        return 1;
+    }
+    settings.raw = format == QLatin1String("rgba");
+    
+    const QString sampling = parser.value(sampling_option).toLower();
+    if (sampling == QLatin1String("off")) {
+        settings.options.sampling = dds::Sampling::Off;
+    } else if (sampling == QLatin1String("texel")) {
+        settings.options.sampling = dds::Sampling::Texel;
+    }
+    if (parser.value(tonemap_option).toLower() == QLatin1String("reinhard")) {
+        settings.options.tone_curve = ToneCurve::Reinhard;
+    }
+    bool ok = false;
+    const int memory = parser.value(memory_option).toInt(&ok);
+    if (!ok || memory < 0) {
+        std::fprintf(stderr, "invalid memory budget\n");
+        return 1;
+    }
+    settings.options.memory_budget = static_cast<std::size_t>(memory) << 20;
+    const int pool = parser.value(pool_option).toInt(&ok);
+    if (!ok || pool < 0) {
+        std::fprintf(stderr, "invalid image pool size\n");
+        return 1;
+    }
+    // Files are decoded in parallel rather than tiles of a file, each file
+    // on the calling thread
+    settings.options.pool = nullptr;
+    
+    // Twice the cores, so that cores stay busy while some workers wait for the
+    // disk
+    const unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+    const int jobs = parser.isSet(jobs_option) ? parser.value(jobs_option).toInt() : static_cast<int>(2 * cores);
+    if (jobs <= 0) {
+        std::fprintf(stderr, "invalid number of jobs\n");
+        return 1;
+    }
+    
+    // A fixed total shared by the jobs, as in the plugin: enough for a few
+    // large images, whatever the number of jobs
+    BufferPool buffers(static_cast<std::size_t>(pool) << 20, true);
+    settings.buffers = &buffers;
+    
+    const QString output_dir = QDir(parser.value(output_option)).absolutePath();
+    FileQueue queue(4 * jobs);
+    Stats stats;
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; ++i) {
+        workers.emplace_back([&] {
+            Entry entry;
+            while (queue.pop(entry)) {
+                const QString error = Thumbnail(entry, settings, stats);
+                ++stats.files;
+                if (!error.isEmpty()) {
+                    std::lock_guard<std::mutex> lock(stats.mutex);
+                    stats.failures.push_back(entry.path + QLatin1String(": ") + error);
+                }
+            }
+        });
+    }
+    Walk(inputs, output_dir, queue);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    std::sort(stats.failures.begin(), stats.failures.end());
+    for (const QString& failure : stats.failures) {
+        std::fprintf(stderr, "%s\n", qPrintable(failure));
+    }
+    std::printf("%zu files, %zu thumbnails, %zu failed in %.2f s: %.1f files/s\n",
+                stats.files.load(), stats.thumbnails.load(), stats.failures.size(), seconds,
+                stats.files / seconds);
+    return stats.failures.empty() ? 0 : 1;
+}
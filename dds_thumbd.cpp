@@ -0,0 +1,534 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// dds-thumbd: fills the freedesktop thumbnail cache with thumbnails of the DDS
+// files of some directories, so that file managers find them there instead
+// of decoding on the first visit. The directories are scanned at start, then
+// watched with inotify: new and modified files are thumbnailed, removed ones
+// lose their thumbnails. The daemon runs at idle CPU and I/O priority, and
+// each file is decoded within a memory and a time budget so that a huge or
+// hostile file cannot hold a worker or exhaust memory.
+//
+// Thumbnails follow the Thumbnail Managing Standard as implemented by KIO:
+// the name is the MD5 of the file URL as returned by QUrl::url(), the PNG
+// holds Thumb::URI and Thumb::MTime, and a thumbnail whose Thumb::MTime
+// matches the file is not written again.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <QtCore/QCommandLineParser>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QCryptographicHash>
+#include <QtCore/QDateTime>
+#include <QtCore/QDir>
+#include <QtCore/QDirIterator>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSaveFile>
+#include <QtCore/QSettings>
+#include <QtCore/QStandardPaths>
+#include <QtCore/QUrl>
+#include <QtGui/QImage>
+#include <QtGui/QImageReader>
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "libdds.h"
+#include "libdds_qt.h"
+
+// Cache directories of the standard, by thumbnail size
+struct CacheSize {
+    const char* name;
+    int size;
+};
+
+static const CacheSize cache_sizes[] = {
+    {"normal",    128},
+    {"large",     256},
+    {"x-large",   512},
+    {"xx-large", 1024},
+};
+
+// Set by SIGINT and SIGTERM, also cancels the files being decoded
+static std::atomic<bool> stop{false};
+
+// Priority ////////////////////////////////////////////////////////////////////
+// Idle scheduling for the CPU and idle class for I/O, inherited by the worker
+// threads. Falls back to the lowest nice value if SCHED_IDLE is refused.
+static void SetIdlePriority()
+{
+    sched_param param = {};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) != 0) {
+        setpriority(PRIO_PROCESS, 0, 19);
+    }
+    // ioprio_set() has no glibc wrapper: IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT
+    constexpr int ioprio_who_process = 1;
+    constexpr int ioprio_class_idle = 3;
+    constexpr int ioprio_class_shift = 13;
+    syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift);
+}
+
+// Thumbnail cache /////////////////////////////////////////////////////////////
+class ThumbnailCache
+{
+    public:
+        // Each file is decoded within time_budget, 0 for none
+        ThumbnailCache(const QString& root, std::vector<CacheSize> sizes, const dds::Options& options, std::chrono::milliseconds time_budget)
+            : root(root), sizes(std::move(sizes)), options(options), time_budget(time_budget)
+        {
+            makeDirectories();
+        }
+
+        // Write the missing or outdated thumbnails of the file
+        void update(const QString& path) const
+        {
+            const QFileInfo info(path);
+            if (!info.isFile()) {
+                return;
+            }
+            const QString uri = QUrl::fromLocalFile(info.absoluteFilePath()).url();
+            const QString name = ThumbnailName(uri);
+            const QString mtime = QString::number(info.lastModified().toSecsSinceEpoch());
+            
+            std::vector<CacheSize> outdated;
+            for (const CacheSize& size : sizes) {
+                QImageReader reader(directory(size) + name, "PNG");
+                if (reader.text(QStringLiteral("Thumb::MTime")) != mtime) {
+                    outdated.push_back(size);
+                }
+            }
+            if (outdated.empty()) {
+                return;
+            }
+            
+            // decoded once for the largest size, smaller sizes are scaled from it
+            const int largest = outdated.back().size;
+            dds::Options file_options = options;
+            if (time_budget.count() > 0) {
+                file_options.deadline = std::chrono::steady_clock::now() + time_budget;
+            }
+            QString error;
+            const QImage img = DecodeThumbnail(path, largest, largest, file_options, error);
+            if (img.isNull()) {
+                if (!stop) {
+                    std::fprintf(stderr, "%s: %s\n", qPrintable(path), qPrintable(error));
+                }
+                return;
+            }
+            for (const CacheSize& size : outdated) {
+                QImage thumbnail = img.width() > size.size || img.height() > size.size
+                                 ? img.scaled(size.size, size.size, Qt::KeepAspectRatio, Qt::SmoothTransformation) : img;
+                thumbnail.setText(QStringLiteral("Thumb::URI"), uri);
+                thumbnail.setText(QStringLiteral("Thumb::MTime"), mtime);
+                thumbnail.setText(QStringLiteral("Thumb::Size"), QString::number(info.size()));
+                thumbnail.setText(QStringLiteral("Thumb::Mimetype"), QStringLiteral("image/x-dds"));
+                thumbnail.setText(QStringLiteral("Software"), QStringLiteral("dds-thumbd"));
+                if (!write(thumbnail, directory(size), name)) {
+                    std::fprintf(stderr, "%s: could not write thumbnail\n", qPrintable(path));
+                }
+            }
+        }
+
+        // Remove the thumbnails of a file that no longer exists
+        void remove(const QString& path) const
+        {
+            const QString name = ThumbnailName(QUrl::fromLocalFile(QFileInfo(path).absoluteFilePath()).url());
+            for (const CacheSize& size : sizes) {
+                QFile::remove(directory(size) + name);
+            }
+        }
+
+    private:
+        static QString ThumbnailName(const QString& uri)
+        {
+            return QString::fromLatin1(QCryptographicHash::hash(QFile::encodeName(uri), QCryptographicHash::Md5).toHex()) + QLatin1String(".png");
+        }
+
+        QString directory(const CacheSize& size) const
+        {
+            return root + QLatin1String(size.name) + QLatin1Char('/');
+        }
+
+        // The standard asks for 0700 directories, made when the cache is
+        // created and again only if they were removed since
+        bool makeDirectories() const
+        {
+            const auto permissions = QFileDevice::ReadOwner | QFileDevice::WriteOwner | QFileDevice::ExeOwner;
+            bool made = true;
+            for (const CacheSize& size : sizes) {
+                made = QDir().mkpath(directory(size)) && QFile::setPermissions(directory(size), permissions) && made;
+            }
+            QFile::setPermissions(root, permissions);
+            return made;
+        }
+
+        // Written to a temporary file renamed over the thumbnail, so readers
+        // never see a partial PNG. The standard asks for 0600 files.
+        bool write(const QImage& thumbnail, const QString& dir, const QString& name) const
+        {
+            QSaveFile file(dir + name);
+            if (!file.open(QIODevice::WriteOnly) && (!makeDirectories() || !file.open(QIODevice::WriteOnly))) {
+                return false;
+            }
+            file.setPermissions(QFileDevice::ReadOwner | QFileDevice::WriteOwner);
+            return thumbnail.save(&file, "PNG") && file.commit();
+        }
+
+        const QString root; ///< ends with /
+        const std::vector<CacheSize> sizes; ///< ascending
+        const dds::Options options;
+        const std::chrono::milliseconds time_budget;
+};
+
+// Work queue //////////////////////////////////////////////////////////////////
+// Files to update or remove, a file queued again before a worker takes it is
+// handled once, with its last event
+class WorkQueue
+{
+    public:
+        void push(const QString& path, bool removed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = pending.find(path);
+            if (it != pending.end()) {
+                it->second = removed;
+                return;
+            }
+            pending.emplace(path, removed);
+            order.push_back(path);
+            not_empty.notify_one();
+        }
+
+        // Wait for a file, false once the queue is closed and empty or the
+        // daemon is stopping
+        bool pop(QString& path, bool& removed)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] {return !order.empty() || closed || stop;});
+            if (order.empty() || stop) {
+                return false;
+            }
+            path = std::move(order.front());
+            order.pop_front();
+            auto it = pending.find(path);
+            removed = it->second;
+            pending.erase(it);
+            return true;
+        }
+
+        // No more files, the queued ones are still handled unless discard
+        void close(bool discard)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            if (discard) {
+                order.clear();
+                pending.clear();
+            }
+            not_empty.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable not_empty;
+        std::deque<QString> order;
+        std::map<QString, bool> pending; ///< path -> removed
+        bool closed = false;
+};
+
+static bool IsDDS(const QString& name)
+{
+    return name.endsWith(QLatin1String(".dds"), Qt::CaseInsensitive);
+}
+
+// Directory watch /////////////////////////////////////////////////////////////
+// inotify watches are not recursive: each directory of the trees gets its own
+// watch, new directories are added and scanned when they appear
+class Watcher
+{
+    public:
+        Watcher(WorkQueue& queue, const QStringList& roots) : queue(queue), roots(roots), fd(inotify_init1(IN_CLOEXEC)) {}
+        ~Watcher() {if (fd >= 0) {close(fd);}}
+
+        bool valid() const {return fd >= 0;}
+
+        // Watch the trees and queue all their DDS files, until stopped
+        void scan()
+        {
+            for (const QString& root : roots) {
+                add(root);
+            }
+        }
+
+        // Handle the pending events, wait for them up to timeout ms. False
+        // once the inotify descriptor fails.
+        bool process(int timeout)
+        {
+            pollfd poll_fd = {fd, POLLIN, 0};
+            const int ready = poll(&poll_fd, 1, timeout);
+            if (ready <= 0) {
+                return ready == 0 || errno == EINTR;
+            }
+            alignas(inotify_event) char buffer[64 * 1024];
+            const ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                return length < 0 && errno == EINTR;
+            }
+            for (char* p = buffer; p < buffer + length;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                handle(*event);
+            }
+            return true;
+        }
+
+    private:
+        static constexpr uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+        // Watch the tree at dir and queue its DDS files
+        void add(const QString& dir)
+        {
+            watch(dir);
+            QDirIterator it(dir, QDir::Dirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+            while (it.hasNext() && !stop) {
+                watch(it.next());
+            }
+            QDirIterator files(dir, {QStringLiteral("*.dds")}, QDir::Files, QDirIterator::Subdirectories);
+            while (files.hasNext() && !stop) {
+                const QString path = files.next();
+                known.insert(path);
+                queue.push(path, false);
+            }
+        }
+
+        void watch(const QString& dir)
+        {
+            const int wd = inotify_add_watch(fd, QFile::encodeName(dir).constData(), mask);
+            if (wd < 0) {
+                std::fprintf(stderr, "%s: could not watch directory\n", qPrintable(dir));
+                return;
+            }
+            dirs[wd] = dir;
+        }
+
+        // Stop watching the tree moved out from dir and queue the removal of
+        // the thumbnails of its files, which are no longer under their path
+        void forget(const QString& dir)
+        {
+            const QString prefix = dir + QLatin1Char('/');
+            for (auto it = dirs.begin(); it != dirs.end();) {
+                if (it->second == dir || it->second.startsWith(prefix)) {
+                    inotify_rm_watch(fd, it->first);
+                    it = dirs.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            for (auto it = known.lower_bound(prefix); it != known.end() && it->startsWith(prefix);) {
+                queue.push(*it, true);
+                it = known.erase(it);
+            }
+        }
+
+        void handle(const inotify_event& event)
+        {
+            if (event.mask & IN_Q_OVERFLOW) {
+                // events were lost, the trees are scanned again, watching a
+                // directory again keeps its watch descriptor
+                scan();
+                return;
+            }
+            if (event.mask & IN_IGNORED) {
+                dirs.erase(event.wd); // directory removed
+                return;
+            }
+            auto it = dirs.find(event.wd);
+            if (it == dirs.end() || event.len == 0) {
+                return;
+            }
+            const QString name = QFile::decodeName(event.name);
+            const QString path = it->second + QLatin1Char('/') + name;
+            if (event.mask & IN_ISDIR) {
+                if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+                    add(path);
+                } else if (event.mask & IN_MOVED_FROM) {
+                    forget(path);
+                }
+                return;
+            }
+            if (!IsDDS(name)) {
+                return;
+            }
+            // a new file is complete once closed, IN_CREATE is not enough
+            if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                known.insert(path);
+                queue.push(path, false);
+            } else if (event.mask & (IN_DELETE | IN_MOVED_FROM)) {
+                known.erase(path);
+                queue.push(path, true);
+            }
+        }
+
+        WorkQueue& queue;
+        const QStringList roots; ///< absolute paths
+        const int fd;
+        std::map<int, QString> dirs; ///< watch descriptor -> directory
+        std::set<QString> known;     ///< DDS files of the trees
+};
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Keep the thumbnail cache filled with thumbnails of the DDS files of directories."));
+    parser.addHelpOption();
+    parser.addPositionalArgument(QStringLiteral("directories"), QStringLiteral("Directories to watch, default the Directories key of dds-thumbdrc."),
+                                 QStringLiteral("directories..."));
+    const QCommandLineOption sizes_option(QStringLiteral("sizes"), QStringLiteral("Comma separated cache sizes: normal, large, x-large, xx-large (default all)."),
+                                          QStringLiteral("list"), QStringLiteral("normal,large,x-large,xx-large"));
+    const QCommandLineOption jobs_option(QStringLiteral("jobs"), QStringLiteral("Files decoded at once (default the number of cores)."), QStringLiteral("n"));
+    const QCommandLineOption once_option(QStringLiteral("once"), QStringLiteral("Update the cache and exit without watching."));
+    const QCommandLineOption memory_option(QStringLiteral("memory"), QStringLiteral("Memory budget of a file in MiB (default 256, 0 for none)."),
+                                           QStringLiteral("mib"), QString::number(dds::default_memory_budget >> 20));
+    const QCommandLineOption timeout_option(QStringLiteral("timeout"), QStringLiteral("Time budget of a file in ms (default 10000, 0 for none)."),
+                                            QStringLiteral("ms"), QStringLiteral("10000"));
+    parser.addOptions({sizes_option, jobs_option, once_option, memory_option, timeout_option});
+    parser.process(app);
+    
+    // Directories from the command line or from the configuration file
+    QStringList directories = parser.positionalArguments();
+    if (directories.isEmpty()) {
+        const QString config = QStandardPaths::locate(QStandardPaths::GenericConfigLocation, QStringLiteral("dds-thumbdrc"));
+        if (!config.isEmpty()) {
+            directories = QSettings(config, QSettings::IniFormat).value(QStringLiteral("Directories")).toStringList();
+        }
+    }
+    if (directories.isEmpty()) {
+        std::fprintf(stderr, "no directory to watch\n");
+        return 1;
+    }
+    
+    std::vector<CacheSize> sizes;
+    for (const QString& name : parser.value(sizes_option).split(QLatin1Char(','), Qt::SkipEmptyParts)) {
+        auto it = std::find_if(std::begin(cache_sizes), std::end(cache_sizes), [&](const CacheSize& size) {
+            return name == QLatin1String(size.name);
+        });
+        if (it == std::end(cache_sizes)) {
+            std::fprintf(stderr, "unknown size %s\n", qPrintable(name));
+            return 1;
+        }
+        sizes.push_back(*it);
+    }
+    if (sizes.empty()) {
+        std::fprintf(stderr, "no size\n");
+        return 1;
+    }
+    std::sort(sizes.begin(), sizes.end(), [](const CacheSize& a, const CacheSize& b) {return a.size < b.size;});
+    sizes.erase(std::unique(sizes.begin(), sizes.end(), [](const CacheSize& a, const CacheSize& b) {return a.size == b.size;}), sizes.end());
+    
+    const int jobs = parser.isSet(jobs_option) ? parser.value(jobs_option).toInt() : static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    if (jobs <= 0) {
+        std::fprintf(stderr, "invalid number of jobs\n");
+        return 1;
+    }
+    bool memory_ok = false;
+    bool timeout_ok = false;
+    const int memory = parser.value(memory_option).toInt(&memory_ok);
+    const int timeout = parser.value(timeout_option).toInt(&timeout_ok);
+    if (!memory_ok || memory < 0 || !timeout_ok || timeout < 0) {
+        std::fprintf(stderr, "invalid memory or time budget\n");
+        return 1;
+    }
+    
+    // before the workers start so that they inherit it
+    SetIdlePriority();
+    
+    // Files are decoded in parallel rather than tiles of a file
+    dds::Options options;
+    options.pool = nullptr;
+    options.cancel = &stop;
+    options.memory_budget = static_cast<std::size_t>(memory) << 20;
+    const ThumbnailCache cache(QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation) + QLatin1String("/thumbnails/"),
+                               sizes, options, std::chrono::milliseconds(timeout));
+    // before the scan, the longest phase on large trees: workers finish the
+    // file they hold and the rest of the queue is dropped
+    std::signal(SIGINT, [](int) {stop = true;});
+    std::signal(SIGTERM, [](int) {stop = true;});
+    
+    WorkQueue queue;
+    std::vector<std::thread> workers;
+    for (int i = 0; i < jobs; ++i) {
+        workers.emplace_back([&] {
+            QString path;
+            bool removed;
+            while (queue.pop(path, removed)) {
+                if (removed) {
+                    cache.remove(path);
+                } else {
+                    cache.update(path);
+                }
+            }
+        });
+    }
+    
+    QStringList roots;
+    for (const QString& dir : directories) {
+        roots.append(QDir(dir).absolutePath());
+    }
+    Watcher watcher(queue, roots);
+    if (!watcher.valid()) {
+        std::fprintf(stderr, "could not initialize inotify\n");
+        queue.close(true);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        return 1;
+    }
+    watcher.scan();
+    
+    if (!parser.isSet(once_option)) {
+        while (!stop && watcher.process(1000)) {
+        }
+    }
+    queue.close(stop);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return 0;
+}
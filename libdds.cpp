@@ -0,0 +1,1402 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// https://github.com/iOrange/bcdec
+// Static like BCDEC_STATIC, bcdec_bc6h_float() is not used
+#define BCDECDEF [[maybe_unused]] static
+#define BCDEC_IMPLEMENTATION
+#include "bcdec.h"
+
+// https://github.com/microsoft/DirectX-Headers/blob/main/include/directx/dxgiformat.h
+#include "dxgiformat.h"
+// https://github.com/microsoft/DirectXTK/blob/main/Src/DDS.h
+#include "DDS.h"
+
+#include "bc_simd.h"
+#include "bc7_simd.h"
+#include "cpu_isa.h"
+#include "convert.h"
+#include "libdds.h"
+#include "thread_pool.h"
+#include "tonemap.h"
+
+namespace dds {
+
+const char* ErrorString(Error error)
+{
+    switch (error) {
+        case Error::None:                return "no error";
+        case Error::OpenFailed:          return "could not open file";
+        case Error::MissingFileType:     return "missing file type";
+        case Error::NotDDS:              return "not a DDS";
+        case Error::MissingHeader:       return "missing header";
+        case Error::MissingDX10Header:   return "missing DX10 header";
+        case Error::InvalidSize:         return "invalid size";
+        case Error::NotTexture2D:        return "not supported (2d texture only)";
+        case Error::UnknownCompressed:   return "unknown bc type";
+        case Error::UnknownUncompressed: return "unsupported uncompressed format";
+        case Error::MissingData:         return "missing image data";
+        case Error::OutOfMemory:         return "could not allocate image";
+        case Error::Cancelled:           return "cancelled";
+        case Error::Timeout:             return "out of time";
+        case Error::OverBudget:          return "over the memory budget";
+    }
+    return "unknown error";
+}
+
+std::size_t PixelSize(PixelFormat format)
+{
+    switch (format) {
+        case PixelFormat::Invalid:     return 0;
+        case PixelFormat::Grayscale8:  return 1;
+        case PixelFormat::Grayscale16:
+        case PixelFormat::RGB444:
+        case PixelFormat::RGB555:
+        case PixelFormat::RGB16:       return 2;
+        case PixelFormat::BGR888:      return 3;
+        case PixelFormat::RGBA8888:
+        case PixelFormat::RGB32:
+        case PixelFormat::ARGB32:      return 4;
+        case PixelFormat::RGBA64:      return 8;
+    }
+    return 0;
+}
+
+// Compressed format ///////////////////////////////////////////////////////////
+#define FOURCC(a, b, c, d) ((a) | ((b) << 8) | ((c) << 16) | ((d) << 24))
+#define FOURCC_DDS  FOURCC('D', 'D', 'S', ' ')
+#define FOURCC_DXT1 FOURCC('D', 'X', 'T', '1')
+#define FOURCC_BC1  FOURCC('B', 'C', '1', ' ')
+#define FOURCC_DXT3 FOURCC('D', 'X', 'T', '3')
+#define FOURCC_BC2  FOURCC('B', 'C', '2', ' ')
+#define FOURCC_DXT5 FOURCC('D', 'X', 'T', '5')
+#define FOURCC_BC3  FOURCC('B', 'C', '3', ' ')
+#define FOURCC_ATI1 FOURCC('A', 'T', 'I', '1')
+#define FOURCC_BC4  FOURCC('B', 'C', '4', ' ')
+#define FOURCC_BC4U FOURCC('B', 'C', '4', 'U')
+#define FOURCC_BC4S FOURCC('B', 'C', '4', 'S')
+#define FOURCC_ATI2 FOURCC('A', 'T', 'I', '2')
+#define FOURCC_BC5  FOURCC('B', 'C', '5', ' ')
+#define FOURCC_BC5U FOURCC('B', 'C', '5', 'U')
+#define FOURCC_BC5S FOURCC('B', 'C', '5', 'S')
+#define FOURCC_DX10 FOURCC('D', 'X', '1', '0')
+
+#define max(a, b) ((a<b)?b:a)
+
+typedef std::size_t (*PFN_CompressedSize)(std::size_t w, std::size_t h);
+static std::size_t CompressedSize8(std::size_t w, std::size_t h)  {return max(1, (w + 3) / 4) * max(1, (h + 3) / 4) * 8;}
+static std::size_t CompressedSize16(std::size_t w, std::size_t h) {return max(1, (w + 3) / 4) * max(1, (h + 3) / 4) * 16;}
+
+typedef void (*PFN_Decode)(const void* compressedBlock, void* decompressedBlock, int destinationPitch);
+// BC6H is decoded to RGB half floats, bcdec takes the pitch in halfs
+static void DecodeBC6H_UF16(const void* compressedBlock, void* decompressedBlock, int destinationPitch)
+{
+    bcdec_bc6h_half(compressedBlock, decompressedBlock, destinationPitch / sizeof(uint16_t), 0);
+}
+static void DecodeBC6H_SF16(const void* compressedBlock, void* decompressedBlock, int destinationPitch)
+{
+    bcdec_bc6h_half(compressedBlock, decompressedBlock, destinationPitch / sizeof(uint16_t), 1);
+}
+
+// HDR codecs have no Convert, their pixels are tone mapped to format_out
+static constexpr struct {
+    std::size_t block_size; ///< compressed block size
+    std::size_t pixel_size; ///< uncompressed pixel size
+    PFN_CompressedSize CompressedSize;
+    PFN_Decode Decode;
+    PixelFormat format_out;
+    PFN_Convert Convert;
+} bc_table[9] = {
+    /*     */ {0                    , 0              , nullptr         , nullptr  , PixelFormat::Invalid,  Convert_NOOP32},
+    /* BC1 */ {BCDEC_BC1_BLOCK_SIZE , 4              , CompressedSize8 , bcdec_bc1, PixelFormat::RGBA8888, Convert_NOOP32},
+    /* BC2 */ {BCDEC_BC2_BLOCK_SIZE , 4              , CompressedSize16, bcdec_bc2, PixelFormat::RGBA8888, Convert_NOOP32},
+    /* BC3 */ {BCDEC_BC3_BLOCK_SIZE , 4              , CompressedSize16, bcdec_bc3, PixelFormat::RGBA8888, Convert_NOOP32},
+    /* BC4 */ {BCDEC_BC4_BLOCK_SIZE , 1              , CompressedSize8 , bcdec_bc4, PixelFormat::Grayscale8, Convert_NOOP8},
+    /* BC5 */ {BCDEC_BC5_BLOCK_SIZE , 2              , CompressedSize16, bcdec_bc5, PixelFormat::RGBA8888, Convert_RGXX8888_RG88}, // no RG format in Qt
+    /* BC6 */ {BCDEC_BC6H_BLOCK_SIZE, 3*sizeof(uint16_t), CompressedSize16, DecodeBC6H_UF16, PixelFormat::RGBA8888, nullptr},
+    /* BC7 */ {BCDEC_BC7_BLOCK_SIZE , 4              , CompressedSize16, bcdec_bc7, PixelFormat::RGBA8888, Convert_NOOP32},
+    /* BC6 signed */ {BCDEC_BC6H_BLOCK_SIZE, 3*sizeof(uint16_t), CompressedSize16, DecodeBC6H_SF16, PixelFormat::RGBA8888, nullptr},
+};
+
+// Uncompressed format /////////////////////////////////////////////////////////
+static constexpr struct {
+    uint32_t component;
+    uint32_t bit_count;
+    uint32_t Rmask;
+    uint32_t Gmask;
+    uint32_t Bmask;
+    uint32_t Amask;
+    PixelFormat format_out;
+    PFN_Convert Convert;
+    DXGI_FORMAT dxgi_format; ///< same layout in a DX10 file, alpha may be dropped
+    FloatLayout hdr = {};    ///< float formats, tone mapped instead of converted
+} uncompressed_table[] = {
+    /* D3DFMT_X4R4G4B4    */ {DDS_RGB,       16, 0x0f00, 0x00f0, 0x000f, 0x0, PixelFormat::RGB444, Convert_XRGB4444, DXGI_FORMAT_B4G4R4A4_UNORM},
+    /* D3DFMT_X1R5G5B5    */ {DDS_RGB,       16, 0x7c00, 0x03e0, 0x001f, 0x0, PixelFormat::RGB555, Convert_XRGB1555, DXGI_FORMAT_B5G5R5A1_UNORM},
+    /* D3FMT_R5G6B5       */ {DDS_RGB,       16, 0xf800, 0x07e0, 0x001f, 0x0, PixelFormat::RGB16,  Convert_NOOP16, DXGI_FORMAT_B5G6R5_UNORM},
+    /* D3DFMT_R8G8B8      */ {DDS_RGB,       24, 0xff0000, 0x00ff00, 0x0000ff, 0x0, PixelFormat::BGR888, Convert_NOOP24, DXGI_FORMAT_UNKNOWN},
+    // /* D3DFMT_G16R16      */ {DDS_RGB,       32, 0x0000ffff, 0xffff0000, 0x0, 0x0,  },
+    /* D3DFMT_X8R8G8B8    */ {DDS_RGB,       32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0x0, PixelFormat::RGB32,  Convert_XRGB32, DXGI_FORMAT_B8G8R8X8_UNORM},
+    // /* D3DFMT_X8B8G8R8    */ {DDS_RGB,       32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0x0, },
+    
+    // /* D3DFMT_A8R3G3B2    */ {DDS_RGBA,      16, 0x00e0, 0x001c, 0x0003, 0xff00},
+    // /* D3DFMT_A4R4G4B4    */ {DDS_RGBA,      16, 0x0f00, 0x00f0, 0x000f, 0xf000, },
+    // /* D3DFMT_A1R5G5B5    */ {DDS_RGBA,      16, 0x7c00, 0x03e0, 0x001f, 0x8000},
+    // /* D3DFMT_G16R16      */ {DDS_RGBA,      32, 0x0000ffff, 0xffff0000, 0x0, 0x0},
+    /* D3DFMT_A8R8G8B8    */ {DDS_RGBA,      32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, PixelFormat::ARGB32, Convert_NOOP32, DXGI_FORMAT_B8G8R8A8_UNORM},
+    // /* D3DFMT_A8B8G8R8    */ {DDS_RGBA,      32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000, },
+    // /* D3DFMT_A2R10G10B10 */ {DDS_RGBA,      32, 0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000, },
+    // /* D3DFMT_A2B10G10R10 */ {DDS_RGBA,      32, 0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000, },
+    
+    /* D3DFMT_L8          */ {DDS_LUMINANCE,  8, 0xff, 0x0, 0x0, 0x0, PixelFormat::Grayscale8, Convert_NOOP8, DXGI_FORMAT_R8_UNORM},
+    // /* D3DFMT_A4L4        */ {DDS_LUMINANCE,  8, 0x0f, 0xf0, 0x0, 0x0, },
+    // /* D3DFMT_A8L8        */ {DDS_LUMINANCE, 16, 0x00ff, 0xff00, 0x0, 0x0, },
+    /* D3DFMT_L16         */ {DDS_LUMINANCE, 16, 0xffff, 0x0, 0x0, 0x0, PixelFormat::Grayscale16, Convert_NOOP16, DXGI_FORMAT_R16_UNORM},
+    
+    /* D3DFMT_A8          */ {DDS_ALPHA,      8, 0x0, 0x0, 0x0, 0xff, PixelFormat::Grayscale8, Convert_NOOP8, DXGI_FORMAT_A8_UNORM},
+    
+    // DX10 only, no component so that UncompressedId() never matches them
+    /* R8G8B8A8_UNORM     */ {0,             32, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, Convert_NOOP32, DXGI_FORMAT_R8G8B8A8_UNORM},
+    /* R10G10B10A2_UNORM  */ {0,             32, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, Convert_RGBA8888_RGB10A2, DXGI_FORMAT_R10G10B10A2_UNORM},
+    /* R8G8_UNORM         */ {0,             16, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, Convert_RGXX8888_RG88, DXGI_FORMAT_R8G8_UNORM}, // no RG format in Qt
+    /* R16G16B16A16_UNORM */ {0,             64, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA64, Convert_NOOP64, DXGI_FORMAT_R16G16B16A16_UNORM},
+    /* R32G32B32A32_FLOAT */ {0,            128, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R32G32B32A32_FLOAT, {4, false}},
+    /* R32G32B32_FLOAT    */ {0,             96, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R32G32B32_FLOAT,    {3, false}},
+    /* R16G16B16A16_FLOAT */ {0,             64, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R16G16B16A16_FLOAT, {4, true}},
+    /* R32G32_FLOAT       */ {0,             64, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R32G32_FLOAT,       {2, false}},
+    /* R16G16_FLOAT       */ {0,             32, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R16G16_FLOAT,       {2, true}},
+    /* R32_FLOAT          */ {0,             32, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R32_FLOAT,          {1, false}},
+    /* R16_FLOAT          */ {0,             16, 0x0, 0x0, 0x0, 0x0, PixelFormat::RGBA8888, nullptr, DXGI_FORMAT_R16_FLOAT,          {1, true}},
+};
+
+static uint32_t UncompressedId(const DirectX::DDS_PIXELFORMAT* ddspf)
+{
+    for (uint32_t i = 0; i < sizeof(uncompressed_table) / sizeof(uncompressed_table[0]); ++i) {
+        if (ddspf->flags == uncompressed_table[i].component
+            && ddspf->RGBBitCount == uncompressed_table[i].bit_count) {
+            if (uncompressed_table[i].component == DDS_ALPHA) {
+                if (ddspf->ABitMask == uncompressed_table[i].Amask) {return i;}
+            } else if (uncompressed_table[i].component == DDS_LUMINANCE) {
+                if (ddspf->RBitMask == uncompressed_table[i].Rmask) {return i;}
+            } else if (uncompressed_table[i].component == DDS_RGB) {
+                if (ddspf->RBitMask == uncompressed_table[i].Rmask
+                    && ddspf->GBitMask == uncompressed_table[i].Gmask
+                    && ddspf->BBitMask == uncompressed_table[i].Bmask) {return i;}
+            } else if (uncompressed_table[i].component == DDS_RGBA) {
+                if (ddspf->RBitMask == uncompressed_table[i].Rmask
+                    && ddspf->GBitMask == uncompressed_table[i].Gmask
+                    && ddspf->BBitMask == uncompressed_table[i].Bmask
+                    && ddspf->ABitMask == uncompressed_table[i].Amask) {return i;}
+            }
+        }
+    }
+    return static_cast<uint32_t>(-1);
+}
+
+static uint32_t DxgiUncompressedId(DXGI_FORMAT dxgi_format)
+{
+    // sRGB and typeless variants share the layout of the UNORM format
+    switch (dxgi_format) {
+        case DXGI_FORMAT_R8G8B8A8_TYPELESS   :
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB : dxgi_format = DXGI_FORMAT_R8G8B8A8_UNORM; break;
+        case DXGI_FORMAT_B8G8R8A8_TYPELESS   :
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB : dxgi_format = DXGI_FORMAT_B8G8R8A8_UNORM; break;
+        case DXGI_FORMAT_B8G8R8X8_TYPELESS   :
+        case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB : dxgi_format = DXGI_FORMAT_B8G8R8X8_UNORM; break;
+        case DXGI_FORMAT_R10G10B10A2_TYPELESS: dxgi_format = DXGI_FORMAT_R10G10B10A2_UNORM; break;
+        case DXGI_FORMAT_R8G8_TYPELESS       : dxgi_format = DXGI_FORMAT_R8G8_UNORM; break;
+        case DXGI_FORMAT_R8_TYPELESS         : dxgi_format = DXGI_FORMAT_R8_UNORM; break;
+        case DXGI_FORMAT_R16_TYPELESS        : dxgi_format = DXGI_FORMAT_R16_UNORM; break;
+        case DXGI_FORMAT_R16G16B16A16_TYPELESS: dxgi_format = DXGI_FORMAT_R16G16B16A16_UNORM; break;
+        default: break;
+    }
+    if (dxgi_format == DXGI_FORMAT_UNKNOWN) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < sizeof(uncompressed_table) / sizeof(uncompressed_table[0]); ++i) {
+        if (uncompressed_table[i].dxgi_format == dxgi_format) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// File access /////////////////////////////////////////////////////////////////
+File::~File()
+{
+    if (map) {
+        munmap(map, file_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool File::open(const char* path)
+{
+    fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        return false;
+    }
+    file_size = st.st_size;
+    void* mapped = file_size > 0 ? mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mapped != MAP_FAILED) {
+        map = static_cast<uint8_t*>(mapped);
+        // Random access so that readahead does not pull unused mip levels;
+        // the decoded range is then marked as sequential in data().
+        advise(0, file_size, MADV_RANDOM);
+    }
+    return true;
+}
+
+const uint8_t* File::data(std::size_t offset, std::size_t length, Access access)
+{
+    if (offset > file_size || length > file_size - offset) {
+        return nullptr;
+    }
+    if (map) {
+        // the map is MADV_RANDOM, isolated ranges keep it so that no read
+        // ahead pulls in the skipped data
+        if (access == Sequential) {
+            advise(offset, length, MADV_SEQUENTIAL);
+        }
+        advise(offset, length, MADV_WILLNEED);
+        return map + offset;
+    }
+    if (length > buffer_size) {
+        buffer.reset(new uint8_t[length]);
+        buffer_size = length;
+    }
+    for (std::size_t done = 0; done < length;) {
+        const ssize_t read = pread(fd, buffer.get() + done, length - done, offset + done);
+        if (read <= 0) {
+            return nullptr;
+        }
+        done += read;
+    }
+    return buffer.get();
+}
+
+void File::release(std::size_t offset, std::size_t length)
+{
+    // the map is read-only, dropped pages are read again if they are touched
+    if (map && offset <= file_size && length <= file_size - offset) {
+        advise(offset, length, MADV_DONTNEED);
+    }
+}
+
+void File::advise(std::size_t offset, std::size_t length, int advice)
+{
+    // madvise() needs a page aligned address, the map itself starts on a page
+    static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t begin = offset / page_size * page_size;
+    madvise(map + begin, length + (offset - begin), advice);
+}
+
+const uint8_t* Memory::data(std::size_t offset, std::size_t length, Access)
+{
+    if (offset > this->length || length > this->length - offset) {
+        return nullptr;
+    }
+    return bytes + offset;
+}
+
+// Headers /////////////////////////////////////////////////////////////////////
+static constexpr std::size_t max_header_size = 4 + sizeof(DirectX::DDS_HEADER) + sizeof(DirectX::DDS_HEADER_DXT10);
+
+// Headers at the start of data, size bytes long
+static Error ParseHeaders(const uint8_t* data, std::size_t size, Info& info)
+{
+    info = Info();
+    
+    // Verify the type of file
+    if (size < 4) {
+        return Error::MissingFileType;
+    }
+    uint32_t magic;
+    std::memcpy(&magic, data, sizeof(magic));
+    if (magic != FOURCC_DDS) {
+        return Error::NotDDS;
+    }
+    
+    // DDS header
+    std::size_t data_offset = 4 + sizeof(DirectX::DDS_HEADER);
+    if (size < data_offset) {
+        return Error::MissingHeader;
+    }
+    DirectX::DDS_HEADER header;
+    std::memcpy(&header, data + 4, sizeof(header));
+    
+    info.width = header.width;
+    info.height = header.height;
+    if (info.width == 0 || info.height == 0 || info.width > max_size || info.height > max_size) {
+        return Error::InvalidSize;
+    }
+    info.mip_count = max(1u, header.mipMapCount);
+    
+    unsigned int bc_codec = 0;
+    uint32_t uncompressed_id = static_cast<uint32_t>(-1);
+    if (header.ddspf.flags & DDS_FOURCC) { // Compressed format, or DX10 uncompressed
+        info.fourcc = header.ddspf.fourCC;
+        switch (header.ddspf.fourCC) {
+        case FOURCC_BC1:
+        case FOURCC_DXT1:
+            bc_codec = 1; break;
+        case FOURCC_BC2:
+        case FOURCC_DXT3:
+            bc_codec = 2; break;
+        case FOURCC_BC3:
+        case FOURCC_DXT5:
+            bc_codec = 3; break;
+        case FOURCC_BC4:
+        case FOURCC_BC4U:
+        case FOURCC_BC4S:
+        case FOURCC_ATI1:
+            bc_codec = 4; break;
+        case FOURCC_BC5:
+        case FOURCC_BC5U:
+        case FOURCC_BC5S:
+        case FOURCC_ATI2:
+            bc_codec = 5; break;
+        case FOURCC_DX10: { // DX10 extended header
+            if (size < data_offset + sizeof(DirectX::DDS_HEADER_DXT10)) {
+                return Error::MissingDX10Header;
+            }
+            DirectX::DDS_HEADER_DXT10 header10;
+            std::memcpy(&header10, data + data_offset, sizeof(header10));
+            data_offset += sizeof(DirectX::DDS_HEADER_DXT10);
+            info.dxgi_format = header10.dxgiFormat;
+            if (header10.resourceDimension != DirectX::DDS_DIMENSION_TEXTURE2D) {
+                // only 2D texture supported
+                return Error::NotTexture2D;
+            }
+            if (header10.miscFlag & DirectX::DDS_RESOURCE_MISC_TEXTURECUBE) {
+                // complete cubes, of which the first one is shown
+                info.cube_faces = 0x3f;
+                info.array_size = 6 * static_cast<std::size_t>(max(1u, header10.arraySize));
+            } else {
+                info.array_size = max(1u, header10.arraySize);
+            }
+            
+            switch (header10.dxgiFormat) {
+            case DXGI_FORMAT_BC1_TYPELESS  :
+            case DXGI_FORMAT_BC1_UNORM     :
+            case DXGI_FORMAT_BC1_UNORM_SRGB:
+                bc_codec = 1; break;
+            case DXGI_FORMAT_BC2_TYPELESS  :
+            case DXGI_FORMAT_BC2_UNORM     :
+            case DXGI_FORMAT_BC2_UNORM_SRGB:
+                bc_codec = 2; break;
+            case DXGI_FORMAT_BC3_TYPELESS  :
+            case DXGI_FORMAT_BC3_UNORM     :
+            case DXGI_FORMAT_BC3_UNORM_SRGB:
+                bc_codec = 3; break;
+            case DXGI_FORMAT_BC4_TYPELESS  :
+            case DXGI_FORMAT_BC4_UNORM     :
+            case DXGI_FORMAT_BC4_SNORM     :
+                bc_codec = 4; break;
+            case DXGI_FORMAT_BC5_TYPELESS  :
+            case DXGI_FORMAT_BC5_UNORM     :
+            case DXGI_FORMAT_BC5_SNORM     :
+                bc_codec = 5; break;
+            case DXGI_FORMAT_BC6H_TYPELESS :
+            case DXGI_FORMAT_BC6H_UF16     :
+                bc_codec = 6; break;
+            case DXGI_FORMAT_BC6H_SF16     :
+                bc_codec = 8; break;
+            case DXGI_FORMAT_BC7_TYPELESS  :
+            case DXGI_FORMAT_BC7_UNORM     :
+            case DXGI_FORMAT_BC7_UNORM_SRGB:
+                bc_codec = 7; break;
+            default:
+                uncompressed_id = DxgiUncompressedId(header10.dxgiFormat);
+                break;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        
+        if (bc_codec == 0 && uncompressed_id == static_cast<uint32_t>(-1)) {
+            return Error::UnknownCompressed;
+        }
+    } else { // uncompressed format
+        uncompressed_id = UncompressedId(&header.ddspf);
+        if (uncompressed_id == static_cast<uint32_t>(-1)) {
+            return Error::UnknownUncompressed;
+        }
+    }
+    
+    // Legacy cube maps store only the faces flagged, in the order of the bits
+    if (!info.cube_faces && (header.caps2 & DDS_CUBEMAP)) {
+        info.cube_faces = (header.caps2 & DDS_CUBEMAP_ALLFACES) >> 10;
+        info.array_size = max(1, __builtin_popcount(info.cube_faces));
+    }
+    
+    if (bc_codec) {
+        info.bc_codec = bc_codec;
+        info.format = bc_table[bc_codec].format_out;
+        // HDR codecs have no Convert
+        info.hdr = !bc_table[bc_codec].Convert;
+    } else {
+        info.uncompressed = uncompressed_id;
+        info.bit_count = uncompressed_table[uncompressed_id].bit_count;
+        info.format = uncompressed_table[uncompressed_id].format_out;
+        info.hdr = uncompressed_table[uncompressed_id].hdr.channels != 0;
+    }
+    
+    info.data_offset = data_offset;
+    return Error::None;
+}
+
+// The file must hold everything the headers describe, so that a truncated
+// or corrupt file fails here rather than after its image is allocated
+static Error CheckPayload(const Info& info, std::size_t file_size)
+{
+    if (info.data_offset > file_size || PayloadSize(info) > file_size - info.data_offset) {
+        return Error::MissingData;
+    }
+    return Error::None;
+}
+
+Error Parse(const uint8_t* data, std::size_t size, Info& info)
+{
+    const Error error = ParseHeaders(data, size, info);
+    return error != Error::None ? error : CheckPayload(info, size);
+}
+
+Error Parse(Source& source, Info& info)
+{
+    const std::size_t size = std::min(source.size(), max_header_size);
+    const uint8_t* data = source.data(0, size, Source::Isolated);
+    const Error error = ParseHeaders(data, data ? size : 0, info);
+    return error != Error::None ? error : CheckPayload(info, source.size());
+}
+
+// Layout //////////////////////////////////////////////////////////////////////
+static std::size_t LevelSize(const Info& info, std::size_t w, std::size_t h)
+{
+    if (info.bc_codec) {
+        return bc_table[info.bc_codec].CompressedSize(w, h);
+    }
+    return (w * info.bit_count + 7) / 8 * h;
+}
+
+std::size_t LevelCount(const Info& info)
+{
+    std::size_t count = 1;
+    for (std::size_t w = info.width, h = info.height; count < info.mip_count && (w > 1 || h > 1); ++count) {
+        w = max(1, w / 2);
+        h = max(1, h / 2);
+    }
+    return count;
+}
+
+MipLevel Level(const Info& info, std::size_t mip)
+{
+    MipLevel level = {info.width, info.height, 0, LevelSize(info, info.width, info.height)};
+    for (std::size_t i = 0; i < mip; ++i) {
+        std::size_t w = max(1, level.width / 2);
+        std::size_t h = max(1, level.height / 2);
+        level = {w, h, level.offset + level.size, LevelSize(info, w, h)};
+    }
+    return level;
+}
+
+std::size_t SliceSize(const Info& info)
+{
+    const MipLevel last = Level(info, LevelCount(info) - 1);
+    return last.offset + last.size;
+}
+
+// Offset in the file of the first level of slice
+static std::size_t SliceOffset(const Info& info, std::size_t slice)
+{
+    return info.data_offset + slice * SliceSize(info);
+}
+
+uint64_t PayloadSize(const Info& info)
+{
+    // 64 bits even where size_t is 32: an uncompressed level can reach 4 GiB
+    uint64_t slice = 0;
+    std::size_t w = info.width;
+    std::size_t h = info.height;
+    for (std::size_t i = 0, count = LevelCount(info); i < count; ++i) {
+        slice += info.bc_codec ? bc_table[info.bc_codec].CompressedSize(w, h) : (uint64_t(w) * info.bit_count + 7) / 8 * h;
+        w = max(1, w / 2);
+        h = max(1, h / 2);
+    }
+    uint64_t size;
+    if (__builtin_mul_overflow(slice, static_cast<uint64_t>(info.array_size), &size)) {
+        return UINT64_MAX;
+    }
+    return size;
+}
+
+std::size_t SelectMipLevel(const Info& info, std::size_t target_width, std::size_t target_height)
+{
+    const std::size_t count = LevelCount(info);
+    std::size_t mip = 0;
+    for (std::size_t w = info.width, h = info.height; mip + 1 < count; ++mip) {
+        w = max(1, w / 2);
+        h = max(1, h / 2);
+        if (w < target_width && h < target_height) {
+            break;
+        }
+    }
+    return mip;
+}
+
+// Levels smaller than this are decoded on the calling thread only, threading
+// them costs more than it saves
+static constexpr std::size_t min_parallel_pixels = 256 * 256;
+
+// Interruption ////////////////////////////////////////////////////////////////
+// Cancellation and deadline of the options, checked by the decoding threads
+// between block rows. The first thread that hits one records it, the others
+// stop at their next check.
+class Interruption
+{
+    public:
+        explicit Interruption(const Options& options) : options(options) {}
+
+        // True if decoding has to stop
+        bool check()
+        {
+            if (stopped.load(std::memory_order_relaxed) != Error::None) {
+                return true;
+            }
+            Error error = Error::None;
+            if (options.cancel && options.cancel->load(std::memory_order_relaxed)) {
+                error = Error::Cancelled;
+            } else if (options.deadline != (std::chrono::steady_clock::time_point::max)()
+                       && std::chrono::steady_clock::now() >= options.deadline) {
+                error = Error::Timeout;
+            }
+            if (error == Error::None) {
+                return false;
+            }
+            stopped.store(error, std::memory_order_relaxed);
+            return true;
+        }
+
+        // Why decoding stopped, Error::None if it did not
+        Error error() const {return stopped.load(std::memory_order_relaxed);}
+
+    private:
+        const Options& options;
+        std::atomic<Error> stopped{Error::None};
+};
+
+// Block decoding //////////////////////////////////////////////////////////////
+// Decode up to count horizontally adjacent blocks at src into dst and return
+// the number of blocks decoded, the caller decodes the others with PFN_Decode
+typedef std::size_t (*PFN_DecodeBlocks)(const uint8_t* src, uint8_t* dst, std::size_t pitch, std::size_t count);
+
+// SIMD multi-block decoder for the codec and this CPU, nullptr if there is none
+static PFN_DecodeBlocks SimdDecoder(unsigned int bc_codec)
+{
+#ifdef BC_SIMD_X86
+    // The AVX-512BW level keeps the AVX2 decoders, the blocks are shuffled
+    // 128 bits at a time and wider registers would not help them
+    const bool avx2 = CpuIsa() >= Isa::AVX2;
+    const bool sse41 = CpuIsa() >= Isa::SSE41;
+    switch (bc_codec) {
+        case 1: return avx2 ? bc_simd::DecodeBlocksBC1_AVX2 : sse41 ? bc_simd::DecodeBlocksBC1_SSE41 : nullptr;
+        case 2: return avx2 ? bc_simd::DecodeBlocksBC2_AVX2 : sse41 ? bc_simd::DecodeBlocksBC2_SSE41 : nullptr;
+        case 3: return avx2 ? bc_simd::DecodeBlocksBC3_AVX2 : sse41 ? bc_simd::DecodeBlocksBC3_SSE41 : nullptr;
+        case 7: return sse41 ? bc_simd::DecodeBlocksBC7_SSE41 : nullptr;
+    }
+#endif
+    return nullptr;
+}
+
+struct DecodeJob {
+    const uint8_t* src;         ///< first block of the level
+    unsigned int bc_codec;
+    PFN_DecodeBlocks DecodeBlocks; ///< nullptr if the codec has no SIMD decoder
+    std::size_t width;          ///< level size in pixels
+    std::size_t height;
+    std::size_t reduce;         ///< texels per side averaged into one output pixel: 1, 2 or 4
+    uint8_t* bits;              ///< first row of the output
+    std::size_t bytes_per_line;
+    std::size_t out_pixel_size; ///< size of an output pixel
+    const ToneMap* tone_map;    ///< HDR codecs only
+    Interruption* interruption;
+};
+
+// Reduced decoding ////////////////////////////////////////////////////////////
+// A level at least 2 or 4 times as large as the thumbnail is reduced while it
+// is decoded: each block becomes 2x2 or 1 pixel, the average of its texels,
+// so the full size image is never written.
+
+// Texels per side averaged into one pixel. Like SelectMipLevel(), the reduced
+// image stays at least as large as the target in one dimension.
+static std::size_t ReduceFactor(const MipLevel& level, std::size_t target_width, std::size_t target_height)
+{
+    const std::size_t ratio = max(level.width / target_width, level.height / target_height);
+    return ratio >= 4 ? 4 : ratio >= 2 ? 2 : 1;
+}
+
+// Average each reduce x reduce box of the rows x columns pixels at src into one
+// pixel at dst, rows is at most 4. Boxes crossing the texture edge only
+// average the texels inside the texture.
+static void ReduceStrip(uint8_t* dst, std::size_t dst_pitch, const uint8_t* src, std::size_t src_pitch,
+                        std::size_t rows, std::size_t columns, std::size_t pixel_size, std::size_t reduce)
+{
+    for (std::size_t y = 0; y < rows; y += reduce, dst += dst_pitch) {
+        const std::size_t box_rows = std::min(reduce, rows - y);
+        const uint8_t* line = src + y * src_pitch;
+        std::size_t x = 0;
+#ifdef __SSE2__
+        // 4 byte pixels of full boxes: rows are summed as 16 bits lanes, then
+        // the pixels of a box are summed by shifting the lanes
+        if (pixel_size == 4 && box_rows == reduce) {
+            const __m128i zero = _mm_setzero_si128();
+            const int shift = reduce == 4 ? 4 : 2;
+            const __m128i round = _mm_set1_epi16(reduce * reduce / 2);
+            for (; x + 4 <= columns; x += 4) {
+                __m128i lo = zero;
+                __m128i hi = zero;
+                for (std::size_t r = 0; r < reduce; ++r) {
+                    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + r * src_pitch + x * 4));
+                    lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(v, zero));
+                    hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(v, zero));
+                }
+                __m128i sum;
+                if (reduce == 4) {
+                    sum = _mm_add_epi16(lo, hi);                         // pixels 0+2, 1+3
+                    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));    // pixels 0+1+2+3
+                } else {
+                    sum = _mm_unpacklo_epi64(_mm_add_epi16(lo, _mm_srli_si128(lo, 8)),  // pixels 0+1
+                                             _mm_add_epi16(hi, _mm_srli_si128(hi, 8))); // pixels 2+3
+                }
+                sum = _mm_srli_epi16(_mm_add_epi16(sum, round), shift);
+                sum = _mm_packus_epi16(sum, sum);
+                if (reduce == 4) {
+                    const int pixel = _mm_cvtsi128_si32(sum);
+                    std::memcpy(dst + x, &pixel, 4);
+                } else {
+                    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst + x * 2), sum);
+                }
+            }
+        }
+#endif
+        for (; x < columns; x += reduce) {
+            const std::size_t box_columns = std::min(reduce, columns - x);
+            const std::size_t count = box_rows * box_columns;
+            uint8_t* out = dst + x / reduce * pixel_size;
+            for (std::size_t c = 0; c < pixel_size; ++c) {
+                unsigned int sum = 0;
+                for (std::size_t r = 0; r < box_rows; ++r) {
+                    for (std::size_t i = 0; i < box_columns; ++i) {
+                        sum += line[r * src_pitch + (x + i) * pixel_size + c];
+                    }
+                }
+                out[c] = (sum + count / 2) / count;
+            }
+        }
+    }
+}
+
+// Decode blocks [bx0, bx1) of block rows [by0, by1). Each 4 rows strip is
+// decoded into a buffer that stays in cache and converted from there into the
+// scanlines, so the image is never held in an intermediate format. Reduced
+// strips are converted into a second buffer and averaged into the scanlines.
+// Instantiated per codec, so that the block decoder and the converter are
+// called directly and can be inlined into the loops.
+template <unsigned int bc_codec>
+static void DecodeTile(const DecodeJob& job, std::size_t by0, std::size_t by1, std::size_t bx0, std::size_t bx1)
+{
+    constexpr std::size_t block_size = bc_table[bc_codec].block_size;
+    constexpr std::size_t pixel_size = bc_table[bc_codec].pixel_size;
+    constexpr PFN_Decode Decode = bc_table[bc_codec].Decode;
+    constexpr PFN_Convert Convert = bc_table[bc_codec].Convert;
+    const std::size_t blocks_x = (job.width + 3) / 4;
+    const std::size_t pitch = job.bytes_per_line;
+    
+    if (Convert == Convert_NOOP32 && pixel_size == 4 && job.reduce == 1) {
+        // Decoded pixels are already in the output format: decode straight
+        // into the image, blocks crossing the right or bottom edge go through
+        // a 4x4 buffer.
+        uint8_t block[4 * 4 * 4];
+        for (std::size_t by = by0; by < by1; ++by) {
+            if (job.interruption->check()) {
+                return;
+            }
+            const uint8_t* src = job.src + (by * blocks_x + bx0) * block_size;
+            uint8_t* dst = job.bits + by * 4 * pitch;
+            const std::size_t rows = std::min<std::size_t>(4, job.height - by * 4);
+            std::size_t bx = bx0;
+            if (job.DecodeBlocks && rows == 4 && bx0 < job.width / 4) {
+                const std::size_t decoded = job.DecodeBlocks(src, dst + bx0 * 4 * 4, pitch, std::min(bx1, job.width / 4) - bx0);
+                bx += decoded;
+                src += decoded * block_size;
+            }
+            for (; bx < bx1; ++bx, src += block_size) {
+                const std::size_t columns = std::min<std::size_t>(4, job.width - bx * 4);
+                if (rows == 4 && columns == 4) {
+                    Decode(src, dst + bx * 4 * 4, pitch);
+                    continue;
+                }
+                Decode(src, block, 4 * 4);
+                for (std::size_t r = 0; r < rows; ++r) {
+                    std::memcpy(dst + r * pitch + bx * 4 * 4, block + r * 4 * 4, columns * 4);
+                }
+            }
+        }
+        return;
+    }
+    
+    // block is fully decoded even if texture size is not multiple of 4
+    thread_local std::vector<uint8_t> strip;
+    const std::size_t strip_pitch = (bx1 - bx0) * 4 * pixel_size;
+    strip.resize(strip_pitch * 4);
+    const std::size_t columns = std::min(bx1 * 4, job.width) - bx0 * 4;
+    thread_local std::vector<uint8_t> converted;
+    const std::size_t converted_pitch = columns * job.out_pixel_size;
+    if (job.reduce > 1) {
+        converted.resize(converted_pitch * 4);
+    }
+    for (std::size_t by = by0; by < by1; ++by) {
+        if (job.interruption->check()) {
+            return;
+        }
+        const uint8_t* src = job.src + (by * blocks_x + bx0) * block_size;
+        std::size_t bx = bx0;
+        if (job.DecodeBlocks) {
+            const std::size_t decoded = job.DecodeBlocks(src, strip.data(), strip_pitch, bx1 - bx0);
+            bx += decoded;
+            src += decoded * block_size;
+        }
+        for (; bx < bx1; ++bx, src += block_size) {
+            Decode(src, &strip[(bx - bx0) * 4 * pixel_size], strip_pitch);
+        }
+        const std::size_t rows = std::min<std::size_t>(4, job.height - by * 4);
+        uint8_t* dst = job.bits + by * 4 / job.reduce * pitch + bx0 * 4 / job.reduce * job.out_pixel_size;
+        uint8_t* line = job.reduce > 1 ? converted.data() : dst;
+        const std::size_t line_pitch = job.reduce > 1 ? converted_pitch : pitch;
+        for (std::size_t r = 0; r < rows; ++r) {
+            if constexpr (Convert == nullptr) {
+                ToneMapRGBHalf(*job.tone_map, line + r * line_pitch, reinterpret_cast<const uint16_t*>(&strip[r * strip_pitch]), columns);
+            } else {
+                Convert(line + r * line_pitch, &strip[r * strip_pitch], columns);
+            }
+        }
+        if (job.reduce > 1) {
+            ReduceStrip(dst, pitch, converted.data(), converted_pitch, rows, columns, job.out_pixel_size, job.reduce);
+        }
+    }
+}
+
+typedef void (*PFN_DecodeTile)(const DecodeJob& job, std::size_t by0, std::size_t by1, std::size_t bx0, std::size_t bx1);
+static constexpr PFN_DecodeTile decode_tile_table[9] = {
+    nullptr, DecodeTile<1>, DecodeTile<2>, DecodeTile<3>, DecodeTile<4>, DecodeTile<5>, DecodeTile<6>, DecodeTile<7>, DecodeTile<8>,
+};
+
+// Decode the blocks at src, width x height pixels, into the rows of pitch
+// bytes at bits, which are the level size divided by reduce. Block rows are
+// split into tasks for the decoding threads, very wide textures with few block
+// rows are also split horizontally into tiles. tone_map is required for HDR
+// codecs. Tiles stop early once interruption is hit.
+static void DecodeImage(const uint8_t* src, std::size_t width, std::size_t height, unsigned int bc_codec, std::size_t reduce,
+                        uint8_t* bits, std::size_t pitch, ThreadPool* pool, const ToneMap* tone_map, Interruption& interruption)
+{
+    const DecodeJob job = {src, bc_codec, SimdDecoder(bc_codec), width, height, reduce,
+                           bits, pitch, PixelSize(bc_table[bc_codec].format_out), tone_map, &interruption};
+    const PFN_DecodeTile DecodeTile = decode_tile_table[bc_codec];
+    const std::size_t blocks_x = (job.width + 3) / 4;
+    const std::size_t blocks_y = (job.height + 3) / 4;
+    
+    if (!pool || pool->size() == 1 || job.width * job.height < min_parallel_pixels) {
+        DecodeTile(job, 0, blocks_y, 0, blocks_x);
+        return;
+    }
+    
+    // A few tasks per thread so that stealing can balance the load, tiles are
+    // at least 64 blocks wide
+    const std::size_t task_count = pool->size() * 4;
+    std::size_t tiles_x = 1;
+    if (blocks_y < task_count) {
+        tiles_x = std::min((task_count + blocks_y - 1) / blocks_y, max(1, blocks_x / 64));
+    }
+    const std::size_t tile_width = (blocks_x + tiles_x - 1) / tiles_x;
+    tiles_x = (blocks_x + tile_width - 1) / tile_width;
+    const std::size_t tile_height = max(1, blocks_y * tiles_x / task_count);
+    const std::size_t tiles_y = (blocks_y + tile_height - 1) / tile_height;
+    
+    pool->parallelFor(tiles_x * tiles_y, [&](std::size_t i) {
+        const std::size_t by0 = i / tiles_x * tile_height;
+        const std::size_t bx0 = i % tiles_x * tile_width;
+        DecodeTile(job, by0, std::min(by0 + tile_height, blocks_y), bx0, std::min(bx0 + tile_width, blocks_x));
+    });
+}
+
+// Convert the uncompressed pixels at src, rows of src_pitch bytes, into bits.
+// Float formats are tone mapped with tone_map, and split between the threads
+// when large as their rows cost more than a copy. Rows stop once interruption
+// is hit.
+static void ConvertImage(const uint8_t* src, std::size_t src_pitch, uint32_t uncompressed, uint8_t* bits, std::size_t pitch,
+                         std::size_t width, std::size_t height, ThreadPool* pool, const ToneMap* tone_map, Interruption& interruption)
+{
+    const auto& format = uncompressed_table[uncompressed];
+    auto ConvertRows = [&](std::size_t first, std::size_t last) {
+        for (std::size_t i = first; i < last; ++i) {
+            if (interruption.check()) {
+                return;
+            }
+            if (tone_map) {
+                ToneMapFloat(*tone_map, format.hdr, bits + i * pitch, src + i * src_pitch, width);
+            } else {
+                format.Convert(bits + i * pitch, src + i * src_pitch, width);
+            }
+        }
+    };
+    
+    if (!tone_map || !pool || pool->size() == 1 || width * height < min_parallel_pixels) {
+        ConvertRows(0, height);
+        return;
+    }
+    const std::size_t task_count = pool->size() * 4;
+    const std::size_t band = (height + task_count - 1) / task_count;
+    pool->parallelFor((height + band - 1) / band, [&](std::size_t i) {
+        ConvertRows(i * band, std::min((i + 1) * band, height));
+    });
+}
+
+// Streaming decode ////////////////////////////////////////////////////////////
+// Levels larger than a chunk are requested and decoded a few block rows at a
+// time, and the rows are released once decoded. Only one chunk of the file is
+// held in memory at once, in the map or in the read buffer, whatever the
+// texture height.
+static constexpr std::size_t stream_chunk_size = 4 << 20;
+
+// Bytes of a row of blocks, or of pixels if the texture is uncompressed
+static std::size_t RowSize(const Info& info, const MipLevel& level)
+{
+    if (info.bc_codec) {
+        return (level.width + 3) / 4 * bc_table[info.bc_codec].block_size;
+    }
+    return (level.width * info.bit_count + 7) / 8;
+}
+
+// Rows requested at once when streaming
+static std::size_t ChunkRows(std::size_t row_size)
+{
+    return max(1, stream_chunk_size / row_size);
+}
+
+// Decode the level at offset in the file into bits, see DecodeImage()
+static Error StreamImage(Source& file, std::size_t offset, const MipLevel& level, unsigned int bc_codec, std::size_t reduce,
+                         uint8_t* bits, std::size_t pitch, ThreadPool* pool, const ToneMap* tone_map, Interruption& interruption)
+{
+    const std::size_t row_size = (level.width + 3) / 4 * bc_table[bc_codec].block_size;
+    const std::size_t blocks_y = (level.height + 3) / 4;
+    const std::size_t chunk_rows = ChunkRows(row_size);
+    for (std::size_t by = 0; by < blocks_y; by += chunk_rows) {
+        const std::size_t rows = std::min(chunk_rows, blocks_y - by);
+        const uint8_t* src = file.data(offset + by * row_size, rows * row_size);
+        if (!src) {
+            return Error::MissingData;
+        }
+        DecodeImage(src, level.width, std::min(rows * 4, level.height - by * 4), bc_codec, reduce,
+                    bits + by * 4 / reduce * pitch, pitch, pool, tone_map, interruption);
+        file.release(offset + by * row_size, rows * row_size);
+        if (interruption.error() != Error::None) {
+            return interruption.error();
+        }
+    }
+    return Error::None;
+}
+
+// Convert the uncompressed level at offset in the file into bits, see
+// ConvertImage()
+static Error StreamPixels(Source& file, std::size_t offset, const MipLevel& level, const Info& info, uint8_t* bits, std::size_t pitch,
+                          ThreadPool* pool, const ToneMap* tone_map, Interruption& interruption)
+{
+    const std::size_t row_size = RowSize(info, level);
+    const std::size_t chunk_rows = ChunkRows(row_size);
+    for (std::size_t y = 0; y < level.height; y += chunk_rows) {
+        const std::size_t rows = std::min(chunk_rows, level.height - y);
+        const uint8_t* src = file.data(offset + y * row_size, rows * row_size);
+        if (!src) {
+            return Error::MissingData;
+        }
+        ConvertImage(src, row_size, info.uncompressed, bits + y * pitch, pitch, level.width, rows, pool, tone_map, interruption);
+        file.release(offset + y * row_size, rows * row_size);
+        if (interruption.error() != Error::None) {
+            return interruption.error();
+        }
+    }
+    return Error::None;
+}
+
+// Sampled decoding ////////////////////////////////////////////////////////////
+// See Sampling. Only the sampled block rows are requested from the file.
+
+// Smallest step, in blocks, that is worth sampling: below it the full decode
+// reads most of the data anyway
+static constexpr std::size_t min_sample_step = 2;
+
+// Number of blocks per output pixel for a level that covers the target, 0 or 1
+// when the level has to be decoded entirely
+static std::size_t SampleStep(const MipLevel& level, std::size_t target_width, std::size_t target_height)
+{
+    return std::min(level.width / 4 / target_width, level.height / 4 / target_height);
+}
+
+// Decode the sampled blocks of the level at offset in the file into the
+// width x height pixels at bits, width and height are (blocks_x / step) and
+// (blocks_y / step). Pixels are converted to the image format before
+// averaging.
+static Error SampleImage(Source& file, std::size_t offset, const MipLevel& level, unsigned int bc_codec, std::size_t step,
+                         Sampling sampling, uint8_t* bits, std::size_t pitch, std::size_t width, std::size_t height, const ToneMap* tone_map,
+                         Interruption& interruption)
+{
+    const std::size_t block_size = bc_table[bc_codec].block_size;
+    const std::size_t pixel_size = bc_table[bc_codec].pixel_size;
+    const std::size_t out_pixel_size = PixelSize(bc_table[bc_codec].format_out);
+    const std::size_t row_size = (level.width + 3) / 4 * block_size;
+    auto Convert = [&](uint8_t* dst, const uint8_t* src, std::size_t count) {
+        if (tone_map) {
+            ToneMapRGBHalf(*tone_map, dst, reinterpret_cast<const uint16_t*>(src), count);
+        } else {
+            bc_table[bc_codec].Convert(dst, src, count);
+        }
+    };
+    
+    alignas(4) uint8_t block[4 * 4 * 3 * sizeof(uint16_t)]; // largest decoded block, BC6H
+    uint8_t converted[4 * 4 * 4];
+    for (std::size_t oy = 0; oy < height; ++oy) {
+        if (interruption.check()) {
+            return interruption.error();
+        }
+        const std::size_t by = oy * step + step / 2;
+        const uint8_t* src = file.data(offset + by * row_size, row_size, Source::Isolated);
+        if (!src) {
+            return Error::MissingData;
+        }
+        const std::size_t rows = std::min<std::size_t>(4, level.height - by * 4);
+        uint8_t* dst = bits + oy * pitch;
+        for (std::size_t ox = 0; ox < width; ++ox, dst += out_pixel_size) {
+            const std::size_t bx = ox * step + step / 2;
+            const std::size_t columns = std::min<std::size_t>(4, level.width - bx * 4);
+            bc_table[bc_codec].Decode(src + bx * block_size, block, 4 * pixel_size);
+            if (sampling == Sampling::Texel) {
+                Convert(dst, block + (std::min<std::size_t>(1, rows - 1) * 4 + std::min<std::size_t>(1, columns - 1)) * pixel_size, 1);
+                continue;
+            }
+            // only the texels inside the texture, edge blocks may be partial
+            for (std::size_t r = 0; r < rows; ++r) {
+                Convert(converted + r * columns * out_pixel_size, block + r * 4 * pixel_size, columns);
+            }
+            const std::size_t count = rows * columns;
+            for (std::size_t c = 0; c < out_pixel_size; ++c) {
+                unsigned int sum = 0;
+                for (std::size_t i = 0; i < count; ++i) {
+                    sum += converted[i * out_pixel_size + c];
+                }
+                dst[c] = (sum + count / 2) / count;
+            }
+        }
+        // so that only one row is held at once, see PlanMemory()
+        file.release(offset + by * row_size, row_size);
+    }
+    return Error::None;
+}
+
+// Uncompressed levels are sampled one texel per step x step pixels, from the
+// texel at the center of each cell
+static std::size_t SamplePixelStep(const MipLevel& level, std::size_t target_width, std::size_t target_height)
+{
+    return std::min(level.width / target_width, level.height / target_height);
+}
+
+// Convert the sampled texels of the uncompressed level at offset in the file
+// into the width x height pixels at bits, width and height are (level.width /
+// step) and (level.height / step)
+static Error SamplePixels(Source& file, std::size_t offset, const MipLevel& level, const Info& info, std::size_t step,
+                          uint8_t* bits, std::size_t pitch, std::size_t width, std::size_t height, const ToneMap* tone_map,
+                          Interruption& interruption)
+{
+    const auto& format = uncompressed_table[info.uncompressed];
+    const std::size_t pixel_size = info.bit_count / 8;
+    const std::size_t row_size = RowSize(info, level);
+    std::vector<uint8_t> texels(width * pixel_size);
+    for (std::size_t oy = 0; oy < height; ++oy) {
+        if (interruption.check()) {
+            return interruption.error();
+        }
+        const std::size_t y = oy * step + step / 2;
+        const uint8_t* src = file.data(offset + y * row_size, row_size, Source::Isolated);
+        if (!src) {
+            return Error::MissingData;
+        }
+        for (std::size_t ox = 0; ox < width; ++ox) {
+            std::memcpy(&texels[ox * pixel_size], src + (ox * step + step / 2) * pixel_size, pixel_size);
+        }
+        file.release(offset + y * row_size, row_size);
+        if (tone_map) {
+            ToneMapFloat(*tone_map, format.hdr, bits + oy * pitch, texels.data(), width);
+        } else {
+            format.Convert(bits + oy * pitch, texels.data(), width);
+        }
+    }
+    return Error::None;
+}
+
+// HDR /////////////////////////////////////////////////////////////////////////
+// Mip level used to estimate the exposure, large enough for a meaningful
+// histogram and cheap to decode
+static constexpr std::size_t exposure_level_size = 32;
+static constexpr std::size_t exposure_max_blocks = 1024;
+
+// Tone mapping of an HDR texture with the curve of the options, the exposure
+// is derived from the luminance histogram of a small mip level of slice.
+static ToneMap HdrToneMap(Source& file, const Info& info, std::size_t slice, const Options& options)
+{
+    ToneMap tone_map;
+    tone_map.curve = options.tone_curve;
+    
+    const unsigned int bc_codec = info.bc_codec;
+    const std::size_t data_offset = SliceOffset(info, slice);
+    const MipLevel level = Level(info, SelectMipLevel(info, exposure_level_size, exposure_level_size));
+    if (!bc_codec) {
+        // float formats: evenly spaced pixels of evenly spaced rows
+        const FloatLayout layout = uncompressed_table[info.uncompressed].hdr;
+        const std::size_t pixel_size = info.bit_count / 8;
+        const std::size_t pitch = level.width * pixel_size;
+        const std::size_t samples = exposure_level_size * 4;
+        const std::size_t step_x = max(1, level.width / samples);
+        const std::size_t step_y = max(1, level.height / samples);
+        ExposureHistogram histogram;
+        for (std::size_t y = 0; y < level.height; y += step_y) {
+            const std::size_t row_offset = data_offset + level.offset + y * pitch;
+            const uint8_t* row = file.data(row_offset, pitch, Source::Isolated);
+            if (!row) {
+                return tone_map;
+            }
+            for (std::size_t x = 0; x < level.width; x += step_x) {
+                float rgba[4];
+                LoadRGBAFloat_C(layout, rgba, row + x * pixel_size, 1);
+                histogram.add(rgba[0], rgba[1], rgba[2]);
+            }
+            file.release(row_offset, pitch);
+        }
+        tone_map.exposure = histogram.exposure();
+        return tone_map;
+    }
+    // without mip levels, sample evenly spaced blocks of level 0, each read
+    // on its own so that the level is not held in memory
+    const std::size_t block_size = bc_table[bc_codec].block_size;
+    const std::size_t blocks = level.size / block_size;
+    const std::size_t step = max(1, blocks / exposure_max_blocks);
+    const uint8_t* src = step == 1 ? file.data(data_offset + level.offset, level.size) : nullptr;
+    if (step == 1 && !src) {
+        return tone_map; // the thumbnail level is checked by the caller
+    }
+    std::vector<uint16_t> pixels((blocks + step - 1) / step * 16 * 3);
+    for (std::size_t i = 0, n = 0; i < blocks; i += step, ++n) {
+        const std::size_t block_offset = data_offset + level.offset + i * block_size;
+        const uint8_t* block = src ? src + i * block_size : file.data(block_offset, block_size, Source::Isolated);
+        if (!block) {
+            return tone_map;
+        }
+        bc_table[bc_codec].Decode(block, &pixels[n * 16 * 3], 4 * 3 * sizeof(uint16_t));
+        if (!src) {
+            file.release(block_offset, block_size);
+        }
+    }
+    tone_map.exposure = AutoExposure(pixels.data(), pixels.size() / 3);
+    return tone_map;
+}
+
+// Memory HdrToneMap() uses: a row of float formats, read and released one at
+// a time, or the blocks of a small level and their decoded pixels
+static std::size_t ExposureMemory(const Info& info)
+{
+    if (!info.hdr) {
+        return 0;
+    }
+    const MipLevel level = Level(info, SelectMipLevel(info, exposure_level_size, exposure_level_size));
+    if (!info.bc_codec) {
+        return RowSize(info, level);
+    }
+    const std::size_t blocks = level.size / bc_table[info.bc_codec].block_size;
+    const std::size_t step = max(1, blocks / exposure_max_blocks);
+    const std::size_t held = step == 1 ? level.size : bc_table[info.bc_codec].block_size;
+    return held + (blocks + step - 1) / step * 16 * 3 * sizeof(uint16_t);
+}
+
+// Decoding ////////////////////////////////////////////////////////////////////
+Plan PlanLevel(const Info& info, std::size_t mip)
+{
+    Plan plan;
+    plan.mip = mip;
+    plan.level = Level(info, mip);
+    plan.width = plan.level.width;
+    plan.height = plan.level.height;
+    plan.format = info.format;
+    return plan;
+}
+
+// Plan of PlanThumbnail() before the memory budget. Uncompressed levels are
+// converted whole unless sample_pixels is set.
+static Plan PlanTarget(const Info& info, std::size_t target_width, std::size_t target_height, Sampling sampling, bool sample_pixels)
+{
+    Plan plan = PlanLevel(info, SelectMipLevel(info, target_width, target_height));
+    if (!info.bc_codec) {
+        const std::size_t step = SamplePixelStep(plan.level, target_width, target_height);
+        if (sample_pixels && step >= 2) {
+            plan.step = step;
+            plan.sampling = Sampling::Texel;
+            plan.width = plan.level.width / step;
+            plan.height = plan.level.height / step;
+        }
+        return plan;
+    }
+    
+    const std::size_t step = SampleStep(plan.level, target_width, target_height);
+    if (sampling != Sampling::Off && step >= min_sample_step) {
+        plan.step = step;
+        plan.sampling = sampling;
+        plan.width = (plan.level.width + 3) / 4 / step;
+        plan.height = (plan.level.height + 3) / 4 / step;
+        return plan;
+    }
+    
+    // reduced by 2 or 4 if the level is that much larger than the target
+    plan.reduce = ReduceFactor(plan.level, target_width, target_height);
+    plan.width = (plan.level.width + plan.reduce - 1) / plan.reduce;
+    plan.height = (plan.level.height + plan.reduce - 1) / plan.reduce;
+    return plan;
+}
+
+// Decode the level of plan of the slice of plan, see Decode()
+static Error DecodeSlice(Source& source, const Info& info, const Plan& plan, ThreadPool* pool, const ToneMap* hdr_tone_map,
+                         Interruption& interruption, uint8_t* bits, std::size_t pitch)
+{
+    const std::size_t offset = SliceOffset(info, plan.slice) + plan.level.offset;
+    if (!info.bc_codec) {
+        // converted in place from the mapped file, chunk by chunk
+        if (plan.step) {
+            return SamplePixels(source, offset, plan.level, info, plan.step, bits, pitch, plan.width, plan.height, hdr_tone_map, interruption);
+        }
+        return StreamPixels(source, offset, plan.level, info, bits, pitch, pool, hdr_tone_map, interruption);
+    }
+    
+    if (plan.step) {
+        return SampleImage(source, offset, plan.level, info.bc_codec, plan.step, plan.sampling, bits, pitch, plan.width, plan.height,
+                           hdr_tone_map, interruption);
+    }
+    // Blocks are decoded in place from the mapped file, large levels chunk by chunk
+    return StreamImage(source, offset, plan.level, info.bc_codec, plan.reduce, bits, pitch, pool, hdr_tone_map, interruption);
+}
+
+// Tiled slices ////////////////////////////////////////////////////////////////
+// Cells of the faces +X, -X, +Y, -Y, +Z, -Z in the 4 x 3 cells of the cross
+static constexpr struct {std::size_t x, y;} cross_cells[6] = {{2, 1}, {0, 1}, {1, 0}, {1, 2}, {1, 1}, {3, 1}};
+
+// Tiles of a plan and the cells of their grid, a single one if the plan
+// decodes a single slice
+struct Tiling {
+    std::size_t count = 1;
+    std::size_t columns = 1;
+    std::size_t rows = 1;
+};
+
+static Tiling PlanTiling(const Plan& plan)
+{
+    Tiling tiling;
+    if (plan.cross) {
+        tiling = {6, 4, 3};
+    } else if (plan.mosaic) {
+        tiling.count = plan.mosaic;
+        while (tiling.columns * tiling.columns < plan.mosaic) {
+            ++tiling.columns;
+        }
+        tiling.rows = (plan.mosaic + tiling.columns - 1) / tiling.columns;
+    }
+    return tiling;
+}
+
+// Plan of PlanTarget() laid out as options tell: a cross of the faces of the
+// first cube of a complete cube map, a mosaic of the first slices of an array
+static Plan PlanTiles(const Info& info, std::size_t target_width, std::size_t target_height, const Options& options, Sampling sampling,
+                      bool sample_pixels)
+{
+    Plan layout;
+    if (info.cube_faces == 0x3f && options.cube_layout == CubeLayout::Cross) {
+        layout.cross = true;
+    } else if (!info.cube_faces && info.array_size > 1 && options.array_layout == ArrayLayout::Mosaic && options.mosaic_tiles > 1) {
+        layout.mosaic = std::min(info.array_size, options.mosaic_tiles);
+    }
+    const Tiling tiling = PlanTiling(layout);
+    Plan plan = PlanTarget(info, max(1, target_width / tiling.columns), max(1, target_height / tiling.rows), sampling, sample_pixels);
+    plan.cross = layout.cross;
+    plan.mosaic = layout.mosaic;
+    plan.width *= tiling.columns;
+    plan.height *= tiling.rows;
+    return plan;
+}
+
+// Decode the tiles of plan, each one a slice decoded by DecodeSlice() into its
+// cell. With a pool and a source that allows it, tiles are decoded in
+// parallel, each on one thread.
+static Error DecodeTiles(Source& source, const Info& info, const Plan& plan, ThreadPool* pool, const ToneMap* tone_map,
+                         Interruption& interruption, uint8_t* bits, std::size_t pitch)
+{
+    const Tiling tiling = PlanTiling(plan);
+    Plan tile = plan;
+    tile.cross = false;
+    tile.mosaic = 0;
+    tile.width = plan.width / tiling.columns;
+    tile.height = plan.height / tiling.rows;
+    const std::size_t pixel_size = PixelSize(plan.format);
+    // the cells of no tile stay transparent black
+    for (std::size_t y = 0; y < plan.height; ++y) {
+        std::memset(bits + y * pitch, 0, plan.width * pixel_size);
+    }
+    
+    std::vector<Error> errors(tiling.count, Error::None);
+    auto DecodeCell = [&](std::size_t t, ThreadPool* tile_pool) {
+        Plan tile_plan = tile;
+        tile_plan.slice = plan.slice + t;
+        const std::size_t x = plan.cross ? cross_cells[t].x : t % tiling.columns;
+        const std::size_t y = plan.cross ? cross_cells[t].y : t / tiling.columns;
+        uint8_t* cell = bits + y * tile.height * pitch + x * tile.width * pixel_size;
+        errors[t] = DecodeSlice(source, info, tile_plan, tile_pool, tone_map, interruption, cell, pitch);
+    };
+    if (pool && pool->size() > 1 && source.concurrent()) {
+        pool->parallelFor(tiling.count, [&](std::size_t t) {DecodeCell(t, nullptr);});
+    } else {
+        for (std::size_t t = 0; t < tiling.count; ++t) {
+            DecodeCell(t, pool);
+        }
+    }
+    for (Error error : errors) {
+        if (error != Error::None) {
+            return error;
+        }
+    }
+    return Error::None;
+}
+
+// Thumbnails //////////////////////////////////////////////////////////////////
+Plan PlanThumbnail(const Info& info, std::size_t target_width, std::size_t target_height, const Options& options)
+{
+    target_width = target_width ? target_width : info.width;
+    target_height = target_height ? target_height : info.height;
+    Plan plan = PlanTiles(info, target_width, target_height, options, options.sampling, false);
+    if (!options.memory_budget || PlanMemory(info, plan) <= options.memory_budget) {
+        return plan;
+    }
+    // over budget: sampled, then for a smaller and smaller target until the
+    // plan fits, down to a single pixel that Decode() refuses if it does not
+    const Sampling sampling = options.sampling == Sampling::Off ? Sampling::Average : options.sampling;
+    for (;;) {
+        plan = PlanTiles(info, target_width, target_height, options, sampling, true);
+        if (PlanMemory(info, plan) <= options.memory_budget || (target_width == 1 && target_height == 1)) {
+            return plan;
+        }
+        target_width = max(1, target_width / 2);
+        target_height = max(1, target_height / 2);
+    }
+}
+
+Plan PlanFallback(const Info& info, const Plan& plan, std::size_t target_width, std::size_t target_height, const Options& options)
+{
+    target_width = target_width ? target_width : info.width;
+    target_height = target_height ? target_height : info.height;
+    Options sampled = options;
+    if (sampled.sampling == Sampling::Off) {
+        sampled.sampling = Sampling::Average;
+    }
+    Plan fallback = PlanThumbnail(info, max(1, target_width / 4), max(1, target_height / 4), sampled);
+    // a smaller level, or sparser blocks of the same level
+    if (fallback.mip == plan.mip && (fallback.step == 0 || (plan.step && fallback.step <= plan.step))) {
+        fallback.width = 0;
+        fallback.height = 0;
+    }
+    return fallback;
+}
+
+std::size_t PlanMemory(const Info& info, const Plan& plan)
+{
+    const std::size_t image = (plan.width * PixelSize(plan.format) + 3) / 4 * 4 * plan.height;
+    // sampled rows are released one by one, other levels a chunk at a time
+    const std::size_t row_size = RowSize(info, plan.level);
+    const std::size_t held = plan.step ? row_size : std::min(plan.level.size, ChunkRows(row_size) * row_size);
+    // the tiles of a cross or a mosaic may be decoded all at once, after the
+    // exposure of HDR textures
+    return image + max(PlanTiling(plan).count * held, ExposureMemory(info));
+}
+
+Error Decode(Source& source, const Info& info, const Plan& plan, const Options& options, uint8_t* bits, std::size_t pitch)
+{
+    if (options.memory_budget && PlanMemory(info, plan) > options.memory_budget) {
+        return Error::OverBudget;
+    }
+    Interruption interruption(options);
+    
+    // HDR: exposure from a small mip level, decoded before the level used for
+    // the image because the unmapped fallback of File::data() reuses its
+    // buffer. The tiles of a cross or a mosaic share the exposure of the first
+    // one.
+    ToneMap tone_map;
+    if (info.hdr) {
+        tone_map = HdrToneMap(source, info, plan.slice, options);
+    }
+    const ToneMap* hdr_tone_map = info.hdr ? &tone_map : nullptr;
+    
+    if (plan.cross || plan.mosaic) {
+        return DecodeTiles(source, info, plan, options.pool, hdr_tone_map, interruption, bits, pitch);
+    }
+    return DecodeSlice(source, info, plan, options.pool, hdr_tone_map, interruption, bits, pitch);
+}
+
+const uint8_t* Pixels(Source& source, const Info& info, const Plan& plan, std::size_t& pitch)
+{
+    if (info.bc_codec || plan.cross || plan.mosaic || plan.width != plan.level.width || plan.height != plan.level.height) {
+        return nullptr;
+    }
+    const PFN_Convert convert = uncompressed_table[info.uncompressed].Convert;
+    if (convert != Convert_NOOP8 && convert != Convert_NOOP16 && convert != Convert_NOOP24
+        && convert != Convert_NOOP32 && convert != Convert_NOOP64) {
+        return nullptr;
+    }
+    pitch = (plan.level.width * info.bit_count + 7) / 8;
+    return source.data(SliceOffset(info, plan.slice) + plan.level.offset, plan.level.size);
+}
+
+} // namespace dds
@@ -0,0 +1,288 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// libdds: parsing and decoding of DDS textures without Qt. Parse() reads the
+// headers, Level() and SliceSize() describe where each mip level and slice
+// lies in the file, and Decode() decodes a level, whole, reduced or sampled,
+// into a buffer of the caller with the caller's pitch. The file is read
+// through a Source, so that only the bytes needed are accessed.
+//
+//     dds::File file;
+//     dds::Info info;
+//     if (file.open(path) && dds::Parse(file, info) == dds::Error::None) {
+//         const dds::Plan plan = dds::PlanThumbnail(info, 256, 256, options);
+//         std::vector<uint8_t> bits(plan.height * plan.width * dds::PixelSize(plan.format));
+//         dds::Decode(file, info, plan, options, bits.data(), plan.width * dds::PixelSize(plan.format));
+//     }
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "tonemap.h"
+
+class ThreadPool;
+
+namespace dds {
+
+enum class Error {
+    None,
+    OpenFailed,          ///< the file could not be opened
+    MissingFileType,     ///< the file is shorter than the magic number
+    NotDDS,              ///< wrong magic number
+    MissingHeader,
+    MissingDX10Header,
+    InvalidSize,         ///< 0 or larger than max_size
+    NotTexture2D,        ///< DX10 1D or 3D texture
+    UnknownCompressed,   ///< FourCC or DXGI format without a decoder
+    UnknownUncompressed, ///< pixel format without a converter
+    MissingData,         ///< the file is shorter than the image data
+    OutOfMemory,         ///< the decoded image could not be allocated
+    Cancelled,           ///< Options::cancel was set during decoding
+    Timeout,             ///< Options::deadline passed during decoding
+    OverBudget,          ///< even the cheapest plan needs more than Options::memory_budget
+};
+
+// Short description of the error, for logs
+const char* ErrorString(Error error);
+
+// Formats of the decoded pixels, each one matches a QImage::Format
+enum class PixelFormat {
+    Invalid,
+    RGBA8888,
+    Grayscale8,
+    Grayscale16,
+    RGB444,  ///< 16 bits xxxxrrrrggggbbbb
+    RGB555,  ///< 16 bits xrrrrrgggggbbbbb
+    RGB16,   ///< 16 bits rrrrrggggggbbbbb
+    BGR888,  ///< 24 bits, QImage::Format_BGR888
+    RGB32,   ///< 32 bits 0xffRRGGBB
+    ARGB32,  ///< 32 bits 0xAARRGGBB
+    RGBA64,  ///< 64 bits, 16 bits per channel in memory order R, G, B, A
+};
+
+// Bytes per pixel
+std::size_t PixelSize(PixelFormat format);
+
+// Largest supported width and height
+constexpr std::size_t max_size = 16384;
+
+// What the headers describe
+struct Info {
+    std::size_t width = 0;
+    std::size_t height = 0;
+    std::size_t mip_count = 1;   ///< levels stored for each slice, the mip chain may be shorter
+    std::size_t array_size = 1;  ///< slices, one after the other with all their levels; the stored faces of each cube of a cube map
+    unsigned int cube_faces = 0; ///< faces stored by a cube map, bits +X (1), -X, +Y, -Y, +Z, -Z (32); 0 if not a cube map
+    std::size_t data_offset = 0; ///< offset of the first level in the file
+    unsigned int bc_codec = 0;   ///< compressed codec, 0 if uncompressed
+    unsigned int uncompressed = 0; ///< uncompressed format, if bc_codec is 0
+    std::size_t bit_count = 0;   ///< uncompressed pixel size in bits
+    PixelFormat format = PixelFormat::Invalid; ///< format of decoded pixels
+    bool hdr = false;            ///< pixels are tone mapped to format
+    uint32_t fourcc = 0;         ///< of the legacy header, for error messages
+    uint32_t dxgi_format = 0;    ///< of the DX10 header, for error messages
+};
+
+struct MipLevel {
+    std::size_t width;
+    std::size_t height;
+    std::size_t offset; ///< offset of the level from the start of image data
+    std::size_t size;   ///< size of the level in bytes
+};
+
+// Levels of a slice, which may be fewer than mip_count if the header claims
+// more than the full mip chain
+std::size_t LevelCount(const Info& info);
+// Level mip of slice 0, mip < LevelCount()
+MipLevel Level(const Info& info, std::size_t mip);
+// Size of a slice with all its levels
+std::size_t SliceSize(const Info& info);
+// Size of the image data of all the slices, UINT64_MAX if it overflows
+uint64_t PayloadSize(const Info& info);
+// Index of the smallest level that is still at least as large as the target
+// in one dimension, so the thumbnail is never upscaled from a smaller level
+std::size_t SelectMipLevel(const Info& info, std::size_t target_width, std::size_t target_height);
+
+// Reading of the file
+class Source
+{
+    public:
+        // How a range returned by data() is read
+        enum Access {
+            Sequential, ///< whole range in order, read ahead is useful
+            Isolated,   ///< only this range, the data around it is skipped
+        };
+
+        virtual ~Source() = default;
+
+        virtual std::size_t size() const = 0;
+        // Pointer to [offset, offset + length), nullptr if the range is outside of the file.
+        // The pointer is valid until the next call.
+        virtual const uint8_t* data(std::size_t offset, std::size_t length, Access access = Sequential) = 0;
+        // Tell that [offset, offset + length) is no longer needed
+        virtual void release(std::size_t offset, std::size_t length) {(void)offset; (void)length;}
+        // Whether data() can be called from several threads at once, the
+        // pointers it returns then stay valid until released
+        virtual bool concurrent() const {return false;}
+};
+
+// Read-only view of a file. The file is memory-mapped so headers and blocks
+// are accessed in place and the kernel only pages in what is actually touched.
+// If mapping fails (some network file systems), requested ranges are read into
+// a buffer instead.
+class File : public Source
+{
+    public:
+        File() = default;
+        ~File() override;
+        File(const File&) = delete;
+        File& operator=(const File&) = delete;
+
+        bool open(const char* path);
+        std::size_t size() const override {return file_size;}
+        const uint8_t* data(std::size_t offset, std::size_t length, Access access = Sequential) override;
+        // Pages of the range are dropped from the map
+        void release(std::size_t offset, std::size_t length) override;
+        bool concurrent() const override {return map != nullptr;}
+
+    private:
+        void advise(std::size_t offset, std::size_t length, int advice);
+
+        int fd = -1;
+        std::size_t file_size = 0;
+        uint8_t* map = nullptr;
+        std::unique_ptr<uint8_t[]> buffer; // data if the file is not mapped
+        std::size_t buffer_size = 0;
+};
+
+// A file already in memory
+class Memory : public Source
+{
+    public:
+        Memory(const uint8_t* bytes, std::size_t length) : bytes(bytes), length(length) {}
+
+        std::size_t size() const override {return length;}
+        const uint8_t* data(std::size_t offset, std::size_t length, Access access = Sequential) override;
+        bool concurrent() const override {return true;}
+
+    private:
+        const uint8_t* bytes;
+        std::size_t length;
+};
+
+// Parse the headers at the start of data, size bytes long, or of the source.
+// Error::MissingData if the file is shorter than the image data it describes,
+// checked before anything is allocated.
+Error Parse(const uint8_t* data, std::size_t size, Info& info);
+Error Parse(Source& source, Info& info);
+
+// Textures many times larger than the thumbnail (atlases without mip levels)
+// are not decoded entirely: the image gets one pixel per step x step blocks,
+// from the block at the center of each cell
+enum class Sampling {
+    Off,     ///< always decode every block
+    Texel,   ///< one texel of the sampled block
+    Average, ///< average of the sampled block
+};
+
+// What the thumbnail of a cube map shows
+enum class CubeLayout {
+    Face,  ///< the first face stored, +X in a complete cube map
+    Cross, ///< the six faces in a horizontal cross, -X +Z +X -Z in the middle row, +Y above and -Y below +Z
+};
+
+// What the thumbnail of a texture array shows
+enum class ArrayLayout {
+    Slice,  ///< the first slice
+    Mosaic, ///< the first Options::mosaic_tiles slices in rows of ceil(sqrt(tiles)) tiles
+};
+
+// Default Options::memory_budget, in bytes
+constexpr std::size_t default_memory_budget = std::size_t(256) << 20;
+
+// Decoding checks cancel and deadline between block rows and stops soon after
+// either one is hit, leaving the image partially decoded
+struct Options {
+    Sampling sampling = Sampling::Average;
+    ToneCurve tone_curve = ToneCurve::ACES;
+    ThreadPool* pool = nullptr; ///< decoding threads, nullptr decodes on the calling thread
+    const std::atomic<bool>* cancel = nullptr; ///< set by another thread to stop decoding
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    std::size_t memory_budget = default_memory_budget; ///< bytes a decode may use, see PlanMemory(), 0 for no limit
+    CubeLayout cube_layout = CubeLayout::Face;
+    ArrayLayout array_layout = ArrayLayout::Slice;
+    std::size_t mosaic_tiles = 16; ///< most slices in a mosaic
+};
+
+// How a level is decoded and the size of the result
+struct Plan {
+    std::size_t slice = 0;  ///< of the level, the first one of the cube for a cross or of the mosaic
+    bool cross = false;     ///< the six faces of a cube map laid out as CubeLayout::Cross, in 4 x 3 cells
+    std::size_t mosaic = 0; ///< slices laid out as ArrayLayout::Mosaic, 0 if a single slice is decoded
+    std::size_t mip = 0;
+    MipLevel level = {};
+    std::size_t reduce = 1; ///< texels per side averaged into one pixel: 1, 2 or 4
+    std::size_t step = 0;   ///< blocks (pixels if uncompressed) per sampled pixel, 0 if every one is decoded
+    Sampling sampling = Sampling::Off;
+    std::size_t width = 0;  ///< of the decoded image, with all the tiles of a cross or a mosaic
+    std::size_t height = 0;
+    PixelFormat format = PixelFormat::Invalid;
+};
+
+// Decode level mip entirely
+Plan PlanLevel(const Info& info, std::size_t mip);
+// Decode the smallest level covering the target, reduced or sampled if it is
+// still several times larger. Cube maps and texture arrays are laid out as
+// options tell, the tiles of a cross or a mosaic share the target and each
+// one is taken from the small level that covers its own part. If that needs
+// more than the memory budget of options, the plan of a smaller and smaller
+// target is taken instead: a smaller level, sampled even if options disable
+// sampling, and for uncompressed textures one texel of every few.
+Plan PlanThumbnail(const Info& info, std::size_t target_width, std::size_t target_height, const Options& options);
+// Cheaper plan to use when plan ran out of time: the plan of a target a
+// quarter the size, sampled even if options disable sampling. The width is 0
+// if it would not read less than plan.
+Plan PlanFallback(const Info& info, const Plan& plan, std::size_t target_width, std::size_t target_height, const Options& options);
+
+// Estimate of the memory Decode() uses for plan: the decoded image and the
+// part of the file held at once, which large levels stream a chunk at a time,
+// or the exposure pass of an HDR texture if it holds more
+std::size_t PlanMemory(const Info& info, const Plan& plan);
+
+// Decode the slice of the source as planned into bits, plan.height rows of pitch
+// bytes of plan.format pixels. The tiles of a cross or a mosaic are decoded in
+// parallel when the source allows it, reading only their own level; cells
+// without a tile are transparent black. Error::OverBudget if PlanMemory() is
+// over the memory budget of options.
+Error Decode(Source& source, const Info& info, const Plan& plan, const Options& options, uint8_t* bits, std::size_t pitch);
+
+// Pixels of the slice as planned straight from the source, when a single level
+// is stored in plan.format and needs no conversion; nullptr otherwise. The
+// pointer is valid as long as the source is.
+const uint8_t* Pixels(Source& source, const Info& info, const Plan& plan, std::size_t& pitch);
+
+} // namespace dds
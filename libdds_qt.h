@@ -0,0 +1,150 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud 
+    SPDX-License-Identifier: GPL-2.0-or-later
+    
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+    
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// QImage side of libdds, for the plugin and the tools
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+#include <QtCore/QFile>
+#include <QtCore/QString>
+#include <QtGui/QImage>
+
+#include "buffer_pool.h"
+#include "libdds.h"
+
+inline QImage::Format ImageFormat(dds::PixelFormat format)
+{
+    switch (format) {
+        case dds::PixelFormat::RGBA8888:    return QImage::Format_RGBA8888;
+        case dds::PixelFormat::Grayscale8:  return QImage::Format_Grayscale8;
+        case dds::PixelFormat::Grayscale16: return QImage::Format_Grayscale16;
+        case dds::PixelFormat::RGB444:      return QImage::Format_RGB444;
+        case dds::PixelFormat::RGB555:      return QImage::Format_RGB555;
+        case dds::PixelFormat::RGB16:       return QImage::Format_RGB16;
+        case dds::PixelFormat::BGR888:      return QImage::Format_BGR888;
+        case dds::PixelFormat::RGB32:       return QImage::Format_RGB32;
+        case dds::PixelFormat::ARGB32:      return QImage::Format_ARGB32;
+        case dds::PixelFormat::RGBA64:      return QImage::Format_RGBA64;
+        case dds::PixelFormat::Invalid:     break;
+    }
+    return QImage::Format_Invalid;
+}
+
+// Image over the pixels of the mapped file when plan needs no conversion, see
+// dds::Pixels(). The image then owns file, released with its last copy. Null
+// if the pixels must be decoded, QImage also needs 32-bit aligned rows.
+inline QImage PixelsImage(std::unique_ptr<dds::File>& file, const dds::Info& info, const dds::Plan& plan)
+{
+    std::size_t pitch = 0;
+    const uint8_t* pixels = dds::Pixels(*file, info, plan, pitch);
+    if (!pixels || reinterpret_cast<std::uintptr_t>(pixels) % 4 != 0 || pitch % 4 != 0) {
+        return QImage();
+    }
+    auto Close = [](void* file) { delete static_cast<dds::File*>(file); };
+    QImage img(pixels, plan.width, plan.height, pitch, ImageFormat(plan.format), Close, file.get());
+    if (!img.isNull()) {
+        file.release();
+    }
+    return img;
+}
+
+// Uninitialized image of the size and format of plan. The bits come from
+// buffers and go back to it with the last copy of the image, or are allocated
+// by QImage if buffers is nullptr.
+inline QImage PlanImage(const dds::Plan& plan, BufferPool* buffers)
+{
+    if (!buffers) {
+        return QImage(plan.width, plan.height, ImageFormat(plan.format));
+    }
+    // rows 32-bit aligned, as QImage allocates them
+    const std::size_t pitch = (plan.width * dds::PixelSize(plan.format) + 3) / 4 * 4;
+    void* bits = buffers->acquire(pitch * plan.height);
+    if (!bits) {
+        return QImage();
+    }
+    QImage img(static_cast<uchar*>(bits), plan.width, plan.height, pitch, ImageFormat(plan.format), BufferPool::Release, bits);
+    if (img.isNull()) {
+        BufferPool::Release(bits);
+    }
+    return img;
+}
+
+// Decode plan into a new image, see PlanImage(). If the deadline of options
+// passes first, the cheaper dds::PlanFallback() is decoded instead, until
+// fallback_deadline. On failure the image is null and error is set.
+inline QImage DecodePlan(dds::Source& source, const dds::Info& info, const dds::Plan& plan, std::size_t target_width, std::size_t target_height,
+                         dds::Options options, std::chrono::steady_clock::time_point fallback_deadline, dds::Error& error,
+                         BufferPool* buffers = nullptr)
+{
+    auto Decode = [&](const dds::Plan& plan) {
+        QImage img = PlanImage(plan, buffers);
+        error = img.isNull() ? dds::Error::OutOfMemory : dds::Decode(source, info, plan, options, img.bits(), img.bytesPerLine());
+        return error == dds::Error::None ? img : QImage();
+    };
+    QImage img = Decode(plan);
+    if (error == dds::Error::Timeout) {
+        const dds::Plan fallback = dds::PlanFallback(info, plan, target_width, target_height, options);
+        if (fallback.width) {
+            options.deadline = fallback_deadline;
+            img = Decode(fallback);
+        }
+    }
+    return img;
+}
+
+// Decode the file at path for a thumbnail of width x height, the image is at
+// least that large unless the texture is smaller or the memory budget of
+// options (dds::default_memory_budget unless set) does not allow it. If the
+// deadline of options passes, the fallback plan of DecodePlan() gets a
+// quarter of the time the first plan had, like in the plugin. On failure the
+// image is null and error describes why.
+inline QImage DecodeThumbnail(const QString& path, std::size_t width, std::size_t height, const dds::Options& options, QString& error,
+                              BufferPool* buffers = nullptr)
+{
+    const auto start = std::chrono::steady_clock::now();
+    auto fallback_deadline = options.deadline;
+    if (options.deadline != std::chrono::steady_clock::time_point::max() && options.deadline > start) {
+        fallback_deadline = options.deadline + (options.deadline - start) / 4;
+    }
+    auto file = std::make_unique<dds::File>();
+    dds::Info info;
+    dds::Error result = file->open(QFile::encodeName(path).constData()) ? dds::Parse(*file, info) : dds::Error::OpenFailed;
+    if (result != dds::Error::None) {
+        error = QLatin1String(dds::ErrorString(result));
+        return QImage();
+    }
+    
+    const dds::Plan plan = dds::PlanThumbnail(info, width, height, options);
+    QImage img = PixelsImage(file, info, plan);
+    if (!img.isNull()) {
+        return img;
+    }
+    img = DecodePlan(*file, info, plan, width, height, options, fallback_deadline, result, buffers);
+    if (img.isNull()) {
+        error = QLatin1String(dds::ErrorString(result));
+    }
+    return img;
+}
@@ -0,0 +1,191 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Each thread owns a queue of tasks: it takes tasks
+// from the front of its own queue and, once it is empty, steals from the back
+// of the other queues. The thread calling parallelFor() owns queue 0 and works
+// on the tasks until they are all done.
+class ThreadPool
+{
+    public:
+        typedef std::function<void(std::size_t)> Task;
+
+        // thread_count includes the thread calling parallelFor()
+        explicit ThreadPool(unsigned int thread_count);
+        ~ThreadPool();
+
+        unsigned int size() const {return queues.size();}
+
+        // Run task(i) for every i in [0, count) and return when they are all done
+        void parallelFor(std::size_t count, const Task &task);
+
+    private:
+        struct Batch {
+            const Task* task;
+            std::atomic<std::size_t> remaining;
+        };
+        struct Item {
+            Batch* batch;
+            std::size_t index;
+        };
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Item> items;
+        };
+
+        bool pop(unsigned int queue, Item& item);
+        void run(const Item& item);
+        void work(unsigned int queue);
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> workers;
+        std::atomic<std::size_t> pending{0}; // items queued but not yet taken
+        std::mutex mutex;
+        std::condition_variable wake; // new items or stop
+        std::condition_variable done; // a batch is finished
+        bool stop = false;
+};
+
+inline ThreadPool::ThreadPool(unsigned int thread_count)
+{
+    thread_count = thread_count ? thread_count : 1;
+    for (unsigned int i = 0; i < thread_count; ++i) {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned int i = 1; i < thread_count; ++i) {
+        workers.emplace_back(&ThreadPool::work, this, i);
+    }
+}
+
+inline ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+inline void ThreadPool::parallelFor(std::size_t count, const Task &task)
+{
+    if (count == 0) {
+        return;
+    }
+    if (workers.empty() || count == 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    // Counted before they are queued so that an item taken as soon as it is
+    // pushed never brings pending below 0. Workers woken in between find the
+    // queues empty for a moment.
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending += count;
+    }
+    // Give each queue a contiguous range, stealing balances the load
+    Batch batch = {&task, {count}};
+    const std::size_t queue_count = queues.size();
+    for (std::size_t q = 0; q < queue_count; ++q) {
+        std::lock_guard<std::mutex> lock(queues[q]->mutex);
+        for (std::size_t i = q * count / queue_count; i < (q + 1) * count / queue_count; ++i) {
+            queues[q]->items.push_back({&batch, i});
+        }
+    }
+    wake.notify_all();
+
+    Item item;
+    while (batch.remaining.load(std::memory_order_acquire) != 0) {
+        if (pop(0, item)) {
+            run(item);
+        } else {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&batch] {return batch.remaining.load(std::memory_order_acquire) == 0;});
+        }
+    }
+}
+
+inline bool ThreadPool::pop(unsigned int queue, Item& item)
+{
+    if (pending.load(std::memory_order_acquire) == 0) {
+        return false;
+    }
+    for (std::size_t i = 0; i < queues.size(); ++i) {
+        Queue& q = *queues[(queue + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.items.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            item = q.items.front();
+            q.items.pop_front();
+        } else {
+            item = q.items.back();
+            q.items.pop_back();
+        }
+        --pending;
+        return true;
+    }
+    return false;
+}
+
+inline void ThreadPool::run(const Item& item)
+{
+    (*item.batch->task)(item.index);
+    if (item.batch->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+    }
+}
+
+inline void ThreadPool::work(unsigned int queue)
+{
+    Item item;
+    for (;;) {
+        if (pop(queue, item)) {
+            run(item);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] {return stop || pending.load(std::memory_order_acquire) != 0;});
+        if (stop && pending.load(std::memory_order_acquire) == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <kio/thumbnailcreator.h>
+
+class DDSCreator : public KIO::ThumbnailCreator
+{
+        Q_OBJECT
+    public:
+        DDSCreator(QObject *parent, const QVariantList &args);
+        virtual ~DDSCreator() = default;
+        
+        KIO::ThumbnailResult create(const KIO::ThumbnailRequest &request) override;
+};
@@ -0,0 +1,379 @@
+/*  SPDX-FileCopyrightText: 2022 Mathieu Eyraud
+    SPDX-License-Identifier: GPL-2.0-or-later
+
+    https://github.com/meyraud705/dds10-thumbnailer-kde
+
+    dds10-thumbnailer-kde
+    Copyright (C) 2022 Mathieu Eyraud
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Tone mapping of HDR pixels (RGB half floats of BC6H, or the float formats of
+// DX10 files) to RGBA8888: pixels are scaled by an exposure, compressed to
+// [0, 1] by a tone curve applied per channel and encoded to sRGB with a lookup
+// table.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "cpu_isa.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TONEMAP_F16C 1
+#endif
+
+enum class ToneCurve {
+    ACES,     ///< filmic curve fitted to ACES by Krzysztof Narkowicz
+    Reinhard, ///< x / (1 + x)
+};
+
+struct ToneMap {
+    float exposure = 1.0f;
+    ToneCurve curve = ToneCurve::ACES;
+};
+
+// Linear [0, 1] quantized to 12 bits to sRGB 8 bits. 3 bytes of padding let
+// the AVX2 gather read 32 bits at the last index.
+struct SrgbTable {
+    static constexpr int size = 4096;
+    uint8_t value[size + 3] = {};
+    SrgbTable()
+    {
+        for (int i = 0; i < size; ++i) {
+            const double l = i / double(size - 1);
+            const double s = l <= 0.0031308 ? l * 12.92 : 1.055 * std::pow(l, 1.0 / 2.4) - 0.055;
+            value[i] = static_cast<uint8_t>(s * 255.0 + 0.5);
+        }
+    }
+};
+
+static const SrgbTable& GetSrgbTable()
+{
+    static const SrgbTable table;
+    return table;
+}
+
+static inline float HalfToFloat(uint16_t h)
+{
+    // Move exponent and mantissa in place and rebias, Inf/NaN get the maximum
+    // exponent and denormals are normalized by subtracting 2^-14
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t bits = (h & 0x7fffu) << 13;
+    const uint32_t exp = bits & shifted_exp;
+    bits += (127 - 15) << 23;
+    float f;
+    if (exp == shifted_exp) {
+        bits += (128 - 16) << 23;
+        std::memcpy(&f, &bits, 4);
+    } else if (exp == 0) {
+        bits += 1 << 23;
+        std::memcpy(&f, &bits, 4);
+        f -= 6.10351562e-05f; // 2^-14
+    } else {
+        std::memcpy(&f, &bits, 4);
+    }
+    return (h & 0x8000) ? -f : f;
+}
+
+// Scaled value to [0, 1]. Negative values (signed formats) and NaN are black,
+// the clamp before the curve keeps Inf out of it.
+static inline float ToneCurveValue(ToneCurve curve, float x)
+{
+    x = x > 0.0f ? std::min(x, 65504.0f) : 0.0f;
+    if (curve == ToneCurve::Reinhard) {
+        return x / (1.0f + x);
+    }
+    return std::min((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 1.0f);
+}
+
+static inline void ToneMapRGBHalf_C(const ToneMap& tm, uint8_t* dst, const uint16_t* src, std::size_t width)
+{
+    const uint8_t* srgb = GetSrgbTable().value;
+    for (std::size_t j = 0; j < width; ++j) {
+        for (int c = 0; c < 3; ++c) {
+            const float v = ToneCurveValue(tm.curve, HalfToFloat(src[3 * j + c]) * tm.exposure);
+            dst[4 * j + c] = srgb[std::lrint(v * (SrgbTable::size - 1))];
+        }
+        dst[4 * j + 3] = 0xff;
+    }
+}
+
+#ifdef TONEMAP_F16C
+// 4 pixels (12 values) per iteration: F16C conversion, tone curve in SSE and
+// sRGB encoding through the table
+__attribute__((target("f16c,sse4.1")))
+static void ToneMapRGBHalf_F16C(const ToneMap& tm, uint8_t* dst, const uint16_t* src, std::size_t width)
+{
+    const uint8_t* srgb = GetSrgbTable().value;
+    const __m128 exposure = _mm_set1_ps(tm.exposure);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 max_half = _mm_set1_ps(65504.0f);
+    const __m128 scale = _mm_set1_ps(SrgbTable::size - 1);
+    const bool aces = tm.curve == ToneCurve::ACES;
+    std::size_t j = 0;
+    for (; j + 4 <= width; j += 4, src += 12, dst += 16) {
+        const __m128i h0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        const __m128i h1 = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + 8));
+        __m128 v[3] = {_mm_cvtph_ps(h0), _mm_cvtph_ps(_mm_unpackhi_epi64(h0, h0)), _mm_cvtph_ps(h1)};
+        alignas(16) int32_t index[12];
+        for (int k = 0; k < 3; ++k) {
+            // max/min return their second operand for NaN, which maps NaN to 0
+            __m128 x = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v[k], exposure), zero), max_half);
+            if (aces) {
+                const __m128 n = _mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+                const __m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+                x = _mm_min_ps(_mm_div_ps(n, d), one);
+            } else {
+                x = _mm_div_ps(x, _mm_add_ps(x, one));
+            }
+            _mm_store_si128(reinterpret_cast<__m128i*>(index + 4 * k), _mm_cvtps_epi32(_mm_mul_ps(x, scale)));
+        }
+        for (int p = 0; p < 4; ++p) {
+            dst[4 * p + 0] = srgb[index[3 * p + 0]];
+            dst[4 * p + 1] = srgb[index[3 * p + 1]];
+            dst[4 * p + 2] = srgb[index[3 * p + 2]];
+            dst[4 * p + 3] = 0xff;
+        }
+    }
+    ToneMapRGBHalf_C(tm, dst, src, width - j);
+}
+#endif
+
+// Tone map width RGB half pixels from src to RGBA8888 pixels in dst
+static inline void ToneMapRGBHalf(const ToneMap& tm, uint8_t* dst, const uint16_t* src, std::size_t width)
+{
+#ifdef TONEMAP_F16C
+    // F16C came with AVX, some CPUs have it below the AVX2 level
+    static const bool f16c = CpuIsa() >= Isa::SSE41 && __builtin_cpu_supports("f16c");
+    if (f16c) {
+        ToneMapRGBHalf_F16C(tm, dst, src, width);
+        return;
+    }
+#endif
+    ToneMapRGBHalf_C(tm, dst, src, width);
+}
+
+// Float formats ///////////////////////////////////////////////////////////////
+// Layout of a pixel of a DX10 float format
+struct FloatLayout {
+    unsigned int channels; ///< 1 (R, shown grey), 2 (RG), 3 (RGB) or 4 (RGBA), 0 if not a float format
+    bool half;             ///< 16 bits floats, else 32 bits
+};
+
+// Row of width float pixels to RGBA floats, single channels are repeated to G
+// and B, B is 0 in 2 channel formats and alpha is 1 when missing
+static inline void LoadRGBAFloat_C(FloatLayout layout, float* dst, const uint8_t* src, std::size_t width)
+{
+    if (layout.channels == 4 && !layout.half) {
+        std::memcpy(dst, src, width * 4 * sizeof(float));
+        return;
+    }
+    const std::size_t channel_size = layout.half ? 2 : 4;
+    for (std::size_t j = 0; j < width; ++j) {
+        float v[4] = {0.0f, 0.0f, 0.0f, 1.0f};
+        for (unsigned int c = 0; c < layout.channels; ++c) {
+            const uint8_t* p = src + (j * layout.channels + c) * channel_size;
+            if (layout.half) {
+                uint16_t h;
+                std::memcpy(&h, p, 2);
+                v[c] = HalfToFloat(h);
+            } else {
+                std::memcpy(&v[c], p, 4);
+            }
+        }
+        if (layout.channels == 1) {
+            v[1] = v[2] = v[0];
+        }
+        std::memcpy(dst + 4 * j, v, sizeof(v));
+    }
+}
+
+// RGBA floats to RGBA8888, alpha is clamped to [0, 1] and not tone mapped
+static inline void ToneMapRGBAFloat_C(const ToneMap& tm, uint8_t* dst, const float* src, std::size_t width)
+{
+    const uint8_t* srgb = GetSrgbTable().value;
+    for (std::size_t j = 0; j < width; ++j) {
+        for (int c = 0; c < 3; ++c) {
+            const float v = ToneCurveValue(tm.curve, src[4 * j + c] * tm.exposure);
+            dst[4 * j + c] = srgb[std::lrint(v * (SrgbTable::size - 1))];
+        }
+        const float a = src[4 * j + 3];
+        dst[4 * j + 3] = a > 0.0f ? static_cast<uint8_t>(std::lrint(std::min(a, 1.0f) * 255.0f)) : 0;
+    }
+}
+
+#ifdef TONEMAP_F16C
+// Halves converted 8 at a time by F16C, then spread to RGBA
+__attribute__((target("f16c,avx")))
+static void LoadRGBAFloat_F16C(FloatLayout layout, float* dst, const uint8_t* src, std::size_t width)
+{
+    const std::size_t count = width * layout.channels;
+    // RGBA is converted straight to dst, the others to the end of dst first so
+    // that spreading them forward never overwrites a value not yet read
+    float* values = dst + 4 * width - count;
+    std::size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        _mm256_storeu_ps(values + i, _mm256_cvtph_ps(h));
+    }
+    for (; i < count; ++i) {
+        uint16_t h;
+        std::memcpy(&h, src + 2 * i, 2);
+        values[i] = HalfToFloat(h);
+    }
+    for (std::size_t j = 0; j < width && layout.channels != 4; ++j) {
+        const float r = values[j * layout.channels];
+        const float g = layout.channels == 2 ? values[j * 2 + 1] : r;
+        dst[4 * j + 0] = r;
+        dst[4 * j + 1] = g;
+        dst[4 * j + 2] = layout.channels == 2 ? 0.0f : r;
+        dst[4 * j + 3] = 1.0f;
+    }
+}
+
+// 8 pixels per iteration: the tone curve on all channels at once, the sRGB
+// table read with gathers and the bytes packed back in pixel order
+__attribute__((target("avx2")))
+static void ToneMapRGBAFloat_AVX2(const ToneMap& tm, uint8_t* dst, const float* src, std::size_t width)
+{
+    const uint8_t* srgb = GetSrgbTable().value;
+    const float e = tm.exposure;
+    const float s = SrgbTable::size - 1;
+    const __m256 exposure = _mm256_setr_ps(e, e, e, 1.0f, e, e, e, 1.0f);
+    const __m256 scale = _mm256_setr_ps(s, s, s, 255.0f, s, s, s, 255.0f);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 max_half = _mm256_set1_ps(65504.0f);
+    const __m256 tiny = _mm256_set1_ps(0x1p-100f);
+    const __m256i byte = _mm256_set1_epi32(0xff);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const bool aces = tm.curve == ToneCurve::ACES;
+    std::size_t j = 0;
+    for (; j + 8 <= width; j += 8) {
+        __m256i out[4];
+        for (int k = 0; k < 4; ++k) {
+            // Values too small to show, negative values and NaN are zeroed
+            // first, so that no product below is denormal, which is slow
+            __m256 v = _mm256_loadu_ps(src + 4 * j + 8 * k);
+            v = _mm256_and_ps(v, _mm256_cmp_ps(v, tiny, _CMP_GE_OQ));
+            __m256 x = _mm256_min_ps(_mm256_mul_ps(v, exposure), max_half);
+            if (aces) {
+                const __m256 n = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+                const __m256 d = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+                x = _mm256_min_ps(_mm256_div_ps(n, d), one);
+            } else {
+                x = _mm256_div_ps(x, _mm256_add_ps(x, one));
+            }
+            // alpha is only clamped
+            x = _mm256_blend_ps(x, _mm256_min_ps(v, one), 0x88);
+            const __m256i index = _mm256_cvtps_epi32(_mm256_mul_ps(x, scale));
+            const __m256i rgb = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(srgb), index, 1), byte);
+            out[k] = _mm256_blend_epi32(rgb, index, 0x88);
+        }
+        // 32 values to bytes, the packs interleave the 128 bit lanes
+        const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(out[0], out[1]), _mm256_packs_epi32(out[2], out[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + 4 * j), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    ToneMapRGBAFloat_C(tm, dst + 4 * j, src + 4 * j, width - j);
+}
+#endif
+
+// Tone map width pixels of a float format from src to RGBA8888 pixels in dst,
+// a chunk at a time through a buffer that stays in L1
+static inline void ToneMapFloat(const ToneMap& tm, FloatLayout layout, uint8_t* dst, const uint8_t* src, std::size_t width)
+{
+    auto Load = LoadRGBAFloat_C;
+    auto Map = ToneMapRGBAFloat_C;
+#ifdef TONEMAP_F16C
+    if (CpuIsa() >= Isa::AVX2) {
+        if (layout.half) {
+            Load = LoadRGBAFloat_F16C;
+        }
+        Map = ToneMapRGBAFloat_AVX2;
+    }
+#endif
+    constexpr std::size_t chunk = 256;
+    alignas(32) float rgba[chunk * 4];
+    const std::size_t pixel_size = layout.channels * (layout.half ? 2 : 4);
+    for (std::size_t j = 0; j < width; j += chunk) {
+        const std::size_t count = std::min(chunk, width - j);
+        Load(layout, rgba, src + j * pixel_size, count);
+        Map(tm, dst + 4 * j, rgba, count);
+    }
+}
+
+// Exposure bringing the average luminance of the pixels added to middle grey.
+// Luminance is binned in a histogram of half-EV bins from 2^-16 to 2^16, the
+// average is taken between the 10th and the 90th percentile so that a few very
+// dark or very bright pixels (sun, emissive) do not drive it. Black and
+// negative pixels are ignored.
+class ExposureHistogram
+{
+    public:
+        void add(float r, float g, float b)
+        {
+            const float l = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+            if (!(l > 1.52587890625e-05f) || std::isinf(l)) { // 2^-16, also skips NaN
+                return;
+            }
+            const int bin = std::min(static_cast<int>((std::log2(l) + 16.0f) * 2.0f), bins - 1);
+            ++histogram[bin];
+            ++lit;
+        }
+
+        float exposure() const
+        {
+            if (lit == 0) {
+                return 1.0f;
+            }
+            const std::size_t low = lit / 10;
+            const std::size_t high = lit - lit / 10;
+            std::size_t seen = 0;
+            std::size_t used = 0;
+            double sum = 0.0;
+            for (int b = 0; b < bins; ++b) {
+                const std::size_t first = std::max(seen, low);
+                const std::size_t last = std::min(seen + histogram[b], high);
+                if (last > first) {
+                    sum += (last - first) * ((b + 0.5) / 2.0 - 16.0);
+                    used += last - first;
+                }
+                seen += histogram[b];
+            }
+            const double average = sum / used;
+            return static_cast<float>(std::clamp(0.18 / std::exp2(average), 1.0 / 65536.0, 65536.0));
+        }
+
+    private:
+        static constexpr int bins = 64;
+        std::size_t histogram[bins] = {};
+        std::size_t lit = 0;
+};
+
+// Exposure of count RGB half pixels, see ExposureHistogram
+static inline float AutoExposure(const uint16_t* src, std::size_t count)
+{
+    ExposureHistogram histogram;
+    for (std::size_t i = 0; i < count; ++i, src += 3) {
+        histogram.add(HalfToFloat(src[0]), HalfToFloat(src[1]), HalfToFloat(src[2]));
+    }
+    return histogram.exposure();
+}